@@ -0,0 +1,108 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Throughput of my_encrypt()/my_decrypt() with every AES backend the CPU
+ * supports. Output of each backend is checked against tiny-AES-c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../src/crypto.h"
+
+#define BENCH_SIZE   (4 << 20)
+#define BENCH_ROUNDS 16
+
+static double bench_time(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_run(unsigned char *key, unsigned char *data, int encrypt) {
+  double start = bench_time();
+  int i;
+
+  for (i = 0; i < BENCH_ROUNDS; i++) {
+    if (encrypt)
+      my_encrypt(key, data, BENCH_SIZE);
+    else
+      my_decrypt(key, data, BENCH_SIZE);
+  }
+  return (double)BENCH_SIZE * BENCH_ROUNDS / (bench_time() - start) / 1e6;
+}
+
+int main(void) {
+  unsigned char key[16] = "best performance";
+  unsigned char *plain, *reference, *data;
+  /* Odd lengths exercise the partial last block */
+  unsigned int lengths[] = {16, 100, 0x800, 0xC00 + 4, BENCH_SIZE};
+  int backend, res = EXIT_SUCCESS;
+  unsigned int i, l;
+
+  plain = malloc(BENCH_SIZE + 16);
+  reference = malloc(BENCH_SIZE + 16);
+  data = malloc(BENCH_SIZE + 16);
+  if (!plain || !reference || !data)
+    return EXIT_FAILURE;
+  srand(1);
+  for (i = 0; i < BENCH_SIZE + 16; i++)
+    plain[i] = rand();
+
+  printf("%-12s %12s %12s\n", "Backend", "Enc MB/s", "Dec MB/s");
+  for (backend = 0; backend < cryptoCOUNT; backend++) {
+    if (crypto_set_backend(backend)) {
+      printf("%-12s %12s %12s\n", crypto_backend_names[backend], "-", "-");
+      continue;
+    }
+
+    for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+      memcpy(data, plain, BENCH_SIZE + 16);
+      my_encrypt(key, data, lengths[l]);
+      crypto_set_backend(cryptoPORTABLE);
+      memcpy(reference, plain, BENCH_SIZE + 16);
+      my_encrypt(key, reference, lengths[l]);
+      crypto_set_backend(backend);
+      my_decrypt(key, data, lengths[l]);
+      crypto_set_backend(cryptoPORTABLE);
+      my_decrypt(key, reference, lengths[l]);
+      crypto_set_backend(backend);
+      if (memcmp(data, reference, BENCH_SIZE + 16)) {
+        fprintf(stderr, "%s differs from %s for %u bytes\n", crypto_backend_names[backend],
+                crypto_backend_names[cryptoPORTABLE], lengths[l]);
+        res = EXIT_FAILURE;
+      }
+    }
+
+    printf("%-12s %12.1f %12.1f\n", crypto_backend_names[backend],
+           bench_run(key, data, 1), bench_run(key, data, 0));
+  }
+
+  free(plain);
+  free(reference);
+  free(data);
+  return res;
+}
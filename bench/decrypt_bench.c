@@ -0,0 +1,94 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Scaling of the segmented --decrypt path with the number of threads.
+ * Every run is checked against the single threaded result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/crypto.h"
+#include "../src/parallel.h"
+
+#define BENCH_SIZE   (16 << 20)
+#define BENCH_ROUNDS 8
+
+static double bench_time(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned char key[16] = "best performance";
+  unsigned char *image, *reference, *data;
+  unsigned int cpus = parallel_cpu_count(), max_threads, threads, i;
+  struct CryptoCtx ctx;
+  double start, base = 0, rate;
+  int res = EXIT_SUCCESS;
+
+  max_threads = argc > 1 ? (unsigned int)atoi(argv[1]) : cpus;
+  if (max_threads == 0)
+    max_threads = 1;
+
+  /* Odd size so the last segment is partial, plus room for its padding */
+  image = malloc(BENCH_SIZE + 16);
+  reference = malloc(BENCH_SIZE + 16);
+  data = malloc(BENCH_SIZE + 16);
+  if (!image || !reference || !data)
+    return EXIT_FAILURE;
+  srand(1);
+  for (i = 0; i < BENCH_SIZE + 16; i++)
+    image[i] = rand();
+
+  crypto_init(&ctx, key);
+  memcpy(reference, image, BENCH_SIZE + 16);
+  crypto_decrypt_segments(&ctx, reference, BENCH_SIZE - 5, 1);
+
+  printf("Backend %s, %u CPUs\n", crypto_backend_names[ctx.backend], cpus);
+  printf("%8s %12s %10s\n", "Threads", "MB/s", "Speedup");
+  for (threads = 1; threads <= max_threads; threads = threads < 4 ? threads + 1 : threads * 2) {
+    memcpy(data, image, BENCH_SIZE + 16);
+    crypto_decrypt_segments(&ctx, data, BENCH_SIZE - 5, threads);
+    if (memcmp(data, reference, BENCH_SIZE + 16)) {
+      fprintf(stderr, "%u threads differ from the serial result\n", threads);
+      res = EXIT_FAILURE;
+    }
+
+    start = bench_time();
+    for (i = 0; i < BENCH_ROUNDS; i++)
+      crypto_decrypt_segments(&ctx, data, BENCH_SIZE - 5, threads);
+    rate = (double)BENCH_SIZE * BENCH_ROUNDS / (bench_time() - start) / 1e6;
+    if (threads == 1)
+      base = rate;
+    printf("%8u %12.1f %9.2fx\n", threads, rate, rate / base);
+  }
+
+  free(image);
+  free(reference);
+  free(data);
+  return res;
+}
@@ -0,0 +1,215 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * End to end flash throughput: stlink_flash() against the emulated
+ * bootloaders over the loopback transport, with the busy times of the
+ * real parts and a latency model of a full-speed or high-speed bus.
+ * Results go to stdout and, as JSON, to the file given as argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../src/stlink.h"
+#include "../src/emulator.h"
+
+#define BENCH_IMAGE "flash_bench.bin"
+
+static const struct {
+  const char *name;
+  enum BlTypes bl_type;
+} bench_bootloaders[] = {
+  {"V2", STLINK_BL_V2},
+  {"V21", STLINK_BL_V21},
+  {"V3", STLINK_BL_V3},
+};
+
+static const struct {
+  const char *name;
+  uint32_t latency_us;
+  uint32_t byte_ns;
+} bench_buses[] = {
+  /* A transfer waits for the next 1 ms frame, 19 bulk packets of 64 bytes per frame */
+  {"full-speed", 1000, 823},
+  /* 125 us microframes, about 40 MB/s of bulk data */
+  {"high-speed", 125, 25},
+};
+
+static const unsigned int bench_sizes_kb[] = {16, 64, 128};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct BenchResult {
+  uint64_t total_us;
+  uint64_t transfers;
+  uint64_t poll_sleep_us;
+  bool verified;
+};
+
+static int bench_write_image(const unsigned char *image, size_t size) {
+  FILE *file = fopen(BENCH_IMAGE, "wb");
+
+  if (!file || fwrite(image, 1, size, file) != size) {
+    fprintf(stderr, "Unable to write %s\n", BENCH_IMAGE);
+    if (file)
+      fclose(file);
+    return -1;
+  }
+  return fclose(file);
+}
+
+/* The tool prints its progress on stdout, the bench table goes there too */
+/* Returns the saved stdout, or -1 if it is left as it is */
+static int bench_mute(void) {
+  int saved, null;
+
+  fflush(stdout);
+  null = open("/dev/null", O_WRONLY);
+  if (null < 0)
+    return -1;
+  saved = dup(STDOUT_FILENO);
+  if (saved >= 0 && dup2(null, STDOUT_FILENO) < 0) {
+    close(saved);
+    saved = -1;
+  }
+  close(null);
+  return saved;
+}
+
+static void bench_unmute(int saved) {
+  if (saved < 0)
+    return;
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+}
+
+static int bench_run(enum BlTypes bl_type, unsigned int bus, const unsigned char *image,
+                     unsigned int size_kb, struct BenchResult *result) {
+  struct Emulator emu;
+  struct STLinkInfo info;
+  uint32_t base = (bl_type == STLINK_BL_V3) ? 0x20000 : 0x4000;
+  uint64_t start;
+  int res, saved;
+
+  /* V2 parts are given room for the largest image after the bootloader */
+  if (emulator_init(&emu, bl_type, (bl_type == STLINK_BL_V3) ? 0 : 160, 1))
+    return -1;
+
+  memset(&info, 0, sizeof(info));
+  memset(info.config.raw_config, 0xFF, sizeof(info.config.raw_config));
+  info.quiet = true;
+  info.stinfo_ep_in = 1 | LIBUSB_ENDPOINT_IN;
+  info.stinfo_ep_out = ((bl_type == STLINK_BL_V3) ? 1 : 2) | LIBUSB_ENDPOINT_OUT;
+  info.stinfo_bl_type = (bl_type == STLINK_BL_V3) ? STLINK_BL_V3 : STLINK_BL_V2;
+  transport_loopback(&info.transport, &emu, bench_buses[bus].latency_us, bench_buses[bus].byte_ns);
+
+  saved = bench_mute();
+  res = stlink_read_info(&info);
+  start = stlink_time_us();
+  info.transport.transfers = 0;
+  if (!res)
+    res = stlink_flash(&info, BENCH_IMAGE, false, false);
+  result->total_us = stlink_time_us() - start;
+  bench_unmute(saved);
+
+  result->transfers = info.transport.transfers;
+  result->poll_sleep_us = info.poll_sleep_us;
+  result->verified = !res && !memcmp(emu.flash + base, image, size_kb << 10);
+  emulator_free(&emu);
+
+  return res;
+}
+
+int main(int argc, char *argv[]) {
+  const char *json_path = argc > 1 ? argv[1] : NULL;
+  unsigned int max_kb = bench_sizes_kb[ARRAY_SIZE(bench_sizes_kb) - 1];
+  unsigned char *image;
+  struct BenchResult result;
+  FILE *json = NULL;
+  unsigned int b, u, s, i;
+  bool first = true;
+  int res = EXIT_SUCCESS;
+
+  image = malloc(max_kb << 10);
+  if (!image)
+    return EXIT_FAILURE;
+  srand(1);
+  for (i = 0; i < max_kb << 10; i++)
+    image[i] = rand();
+
+  if (json_path) {
+    json = fopen(json_path, "w");
+    if (!json) {
+      fprintf(stderr, "Unable to open %s\n", json_path);
+      free(image);
+      return EXIT_FAILURE;
+    }
+    fprintf(json, "{\n  \"benchmark\": \"flash\",\n  \"results\": [");
+  }
+
+  printf("%-4s %-10s %6s %10s %8s %10s %12s %s\n", "BL", "Bus", "KB", "Total ms",
+         "ms/KB", "Trips/KB", "Poll sleep", "Check");
+  for (b = 0; b < ARRAY_SIZE(bench_bootloaders); b++) {
+    for (u = 0; u < ARRAY_SIZE(bench_buses); u++) {
+      for (s = 0; s < ARRAY_SIZE(bench_sizes_kb); s++) {
+        if (bench_write_image(image, bench_sizes_kb[s] << 10)) {
+          res = EXIT_FAILURE;
+          goto exit;
+        }
+        if (bench_run(bench_bootloaders[b].bl_type, u, image, bench_sizes_kb[s], &result) ||
+            !result.verified)
+          res = EXIT_FAILURE;
+
+        printf("%-4s %-10s %6u %10.1f %8.2f %10.2f %12.1f %s\n", bench_bootloaders[b].name,
+               bench_buses[u].name, bench_sizes_kb[s], result.total_us / 1000.0,
+               result.total_us / 1000.0 / bench_sizes_kb[s],
+               (double)result.transfers / bench_sizes_kb[s], result.poll_sleep_us / 1000.0,
+               result.verified ? "ok" : "FAILED");
+        if (json) {
+          fprintf(json, "%s\n    {\"bootloader\": \"%s\", \"bus\": \"%s\", \"image_kb\": %u, "
+                  "\"total_ms\": %.3f, \"ms_per_kb\": %.3f, \"round_trips\": %llu, "
+                  "\"round_trips_per_kb\": %.3f, \"poll_sleep_ms\": %.3f, \"verified\": %s}",
+                  first ? "" : ",", bench_bootloaders[b].name, bench_buses[u].name,
+                  bench_sizes_kb[s], result.total_us / 1000.0,
+                  result.total_us / 1000.0 / bench_sizes_kb[s],
+                  (unsigned long long)result.transfers,
+                  (double)result.transfers / bench_sizes_kb[s], result.poll_sleep_us / 1000.0,
+                  result.verified ? "true" : "false");
+          first = false;
+        }
+      }
+    }
+  }
+
+exit:
+  if (json) {
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+  }
+  unlink(BENCH_IMAGE);
+  free(image);
+  return res;
+}
@@ -0,0 +1,245 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Cost of the per-chunk hot path functions by chunk size: 16 bytes (config
+ * tags), 0x800 (V2 chunks), 0xC00 (decrypt segments) and a whole image.
+ * Warm runs call the function again and again on the same buffer. Cold runs
+ * flush the buffer from the caches before every call and only time the
+ * call. On x86 with SSE2 cycles are TSC reference cycles, elsewhere only
+ * MB/s is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+/* clflush and lfence come with SSE2, i686 builds without it use the fallback */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+  #include <x86intrin.h>
+  #define BENCH_TSC
+#endif
+
+#include "../src/crypto.h"
+#include "../src/stlink.h"
+
+#define BENCH_IMAGE_SIZE  (128 << 10)
+/* Work per warm measurement, and calls per cold one */
+#define BENCH_WARM_BYTES  (32 << 20)
+#define BENCH_COLD_CALLS  512
+#ifndef BENCH_TSC
+  /* Evicts the caches by walking a buffer larger than the last level cache */
+  #define BENCH_EVICT_SIZE  (64 << 20)
+#endif
+
+static unsigned char bench_key[16] = "best performance";
+static struct CryptoCtx bench_ctx;
+static volatile uint16_t bench_sink;
+
+static void bench_my_encrypt(unsigned char *data, unsigned int len) {
+  my_encrypt(bench_key, data, len);
+}
+
+static void bench_my_decrypt(unsigned char *data, unsigned int len) {
+  my_decrypt(bench_key, data, len);
+}
+
+static void bench_crypto_encrypt(unsigned char *data, unsigned int len) {
+  crypto_encrypt(&bench_ctx, data, len);
+}
+
+static void bench_crypto_decrypt(unsigned char *data, unsigned int len) {
+  crypto_decrypt(&bench_ctx, data, len);
+}
+
+static void bench_convert(unsigned char *data, unsigned int len) {
+  convert_to_big_endian(data, len);
+}
+
+static void bench_checksum(unsigned char *data, unsigned int len) {
+  bench_sink = stlink_checksum(data, len);
+}
+
+/* The DFU seal as it was, two passes over the chunk */
+static void bench_encrypt_then_sum(unsigned char *data, unsigned int len) {
+  bench_sink = stlink_checksum(data, len);
+  crypto_encrypt(&bench_ctx, data, len);
+}
+
+static void bench_encrypt_sum(unsigned char *data, unsigned int len) {
+  bench_sink = crypto_encrypt_sum(&bench_ctx, data, len);
+}
+
+static const struct {
+  const char *name;
+  void (*fn)(unsigned char *data, unsigned int len);
+} bench_functions[] = {
+  {"my_encrypt", bench_my_encrypt},
+  {"my_decrypt", bench_my_decrypt},
+  /* Key schedule expanded once, as stlink.c does per session */
+  {"crypto_encrypt", bench_crypto_encrypt},
+  {"crypto_decrypt", bench_crypto_decrypt},
+  {"convert_to_big_endian", bench_convert},
+  {"stlink_checksum", bench_checksum},
+  {"checksum+encrypt", bench_encrypt_then_sum},
+  {"crypto_encrypt_sum", bench_encrypt_sum},
+};
+
+static const unsigned int bench_sizes[] = {16, 0x800, 0xC00, BENCH_IMAGE_SIZE};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Ticks of the TSC, or nanoseconds */
+static uint64_t bench_ticks(void) {
+#ifdef BENCH_TSC
+  _mm_lfence();
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double bench_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Ticks per second, measured against the monotonic clock */
+static double bench_tick_rate(void) {
+  double start = bench_seconds(), end;
+  uint64_t ticks = bench_ticks();
+
+  do {
+    end = bench_seconds();
+  } while (end - start < 0.1);
+  return (bench_ticks() - ticks) / (end - start);
+}
+
+/* Cost of reading the tick counter twice, taken off every cold call */
+static uint64_t bench_overhead(void) {
+  uint64_t best = UINT64_MAX, start, ticks;
+  int i;
+
+  for (i = 0; i < 1000; i++) {
+    start = bench_ticks();
+    ticks = bench_ticks() - start;
+    if (ticks < best)
+      best = ticks;
+  }
+  return best;
+}
+
+static void bench_evict(unsigned char *data, unsigned int len, unsigned char *scratch) {
+#ifdef BENCH_TSC
+  unsigned int i;
+
+  for (i = 0; i < len; i += 64)
+    _mm_clflush(data + i);
+  _mm_clflush(data + len - 1);
+  _mm_mfence();
+#else
+  unsigned int i;
+
+  for (i = 0; i < BENCH_EVICT_SIZE; i += 64)
+    scratch[i]++;
+#endif
+}
+
+/* Ticks per byte */
+static double bench_warm(void (*fn)(unsigned char *, unsigned int), unsigned char *data,
+                         unsigned int len) {
+  unsigned int calls = BENCH_WARM_BYTES / len, i;
+  uint64_t start;
+
+  fn(data, len);
+  start = bench_ticks();
+  for (i = 0; i < calls; i++)
+    fn(data, len);
+  return (double)(bench_ticks() - start) / ((double)calls * len);
+}
+
+static double bench_cold(void (*fn)(unsigned char *, unsigned int), unsigned char *data,
+                         unsigned int len, unsigned char *scratch, uint64_t overhead) {
+  uint64_t total = 0, start, ticks;
+  unsigned int i;
+
+  for (i = 0; i < BENCH_COLD_CALLS; i++) {
+    bench_evict(data, len, scratch);
+    start = bench_ticks();
+    fn(data, len);
+    ticks = bench_ticks() - start;
+    total += ticks > overhead ? ticks - overhead : 0;
+  }
+  return (double)total / ((double)BENCH_COLD_CALLS * len);
+}
+
+int main(void) {
+  unsigned char *data, *scratch = NULL;
+  double rate, warm, cold;
+  uint64_t overhead;
+  unsigned int f, s, i;
+
+  data = malloc(BENCH_IMAGE_SIZE);
+#ifndef BENCH_TSC
+  scratch = calloc(1, BENCH_EVICT_SIZE);
+  if (!scratch)
+    return EXIT_FAILURE;
+#endif
+  if (!data)
+    return EXIT_FAILURE;
+  srand(1);
+  for (i = 0; i < BENCH_IMAGE_SIZE; i++)
+    data[i] = rand();
+  crypto_init(&bench_ctx, bench_key);
+
+  rate = bench_tick_rate();
+  overhead = bench_overhead();
+  printf("Backend %s", crypto_backend_names[bench_ctx.backend]);
+#ifdef BENCH_TSC
+  printf(", TSC at %.2f GHz", rate / 1e9);
+#endif
+  printf("\n%-22s %8s %10s %10s %10s %10s\n", "Function", "Bytes", "Warm c/B", "Warm MB/s",
+         "Cold c/B", "Cold MB/s");
+
+  for (f = 0; f < ARRAY_SIZE(bench_functions); f++) {
+    for (s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+      warm = bench_warm(bench_functions[f].fn, data, bench_sizes[s]);
+      cold = bench_cold(bench_functions[f].fn, data, bench_sizes[s], scratch, overhead);
+#ifdef BENCH_TSC
+      printf("%-22s %8u %10.2f %10.1f %10.2f %10.1f\n", bench_functions[f].name, bench_sizes[s],
+             warm, rate / warm / 1e6, cold, rate / cold / 1e6);
+#else
+      printf("%-22s %8u %10s %10.1f %10s %10.1f\n", bench_functions[f].name, bench_sizes[s],
+             "-", rate / warm / 1e6, "-", rate / cold / 1e6);
+#endif
+    }
+  }
+
+  free(data);
+  free(scratch);
+  return EXIT_SUCCESS;
+}
@@ -27,12 +27,22 @@
   #include <arpa/inet.h>
 #endif
 
-#include "../tiny-AES-c/aes.h"
 #include "crypto.h"
+#include "parallel.h"
 
-static void convert_to_big_endian(unsigned char *array, unsigned int length);
+const char *crypto_backend_names[] = {
+  [cryptoPORTABLE] = "tiny-AES-c",
+  [cryptoAESNI] = "AES-NI",
+  [cryptoVAES] = "VAES",
+};
 
-static void convert_to_big_endian(unsigned char *array, unsigned int length) {
+/* cryptoCOUNT until the first use picks the best supported backend */
+static enum CryptoBackend crypto_backend = cryptoCOUNT;
+
+/* NULL until the first use picks the widest supported byte sum */
+static uint32_t (*crypto_sum_impl)(const uint8_t *data, size_t length);
+
+void convert_to_big_endian(unsigned char *array, unsigned int length) {
   unsigned int i;
 
   for (i = 0; i < length; i += 4) {
@@ -40,38 +50,207 @@ static void convert_to_big_endian(unsigned char *array, unsigned int length) {
   }
 }
 
-void my_encrypt(unsigned char *key, unsigned char *data, unsigned int length) {
-  struct AES_ctx ctx;
+int crypto_backend_supported(enum CryptoBackend backend) {
+  switch (backend) {
+  case cryptoPORTABLE:
+    return 1;
+  case cryptoAESNI:
+    return aesni_supported();
+  case cryptoVAES:
+    return vaes_supported();
+  default:
+    return 0;
+  }
+}
+
+enum CryptoBackend crypto_get_backend(void) {
+  enum CryptoBackend backend = __atomic_load_n(&crypto_backend, __ATOMIC_RELAXED);
+
+  if (backend == cryptoCOUNT) {
+    backend = cryptoPORTABLE;
+    if (vaes_supported())
+      backend = cryptoVAES;
+    else if (aesni_supported())
+      backend = cryptoAESNI;
+    __atomic_store_n(&crypto_backend, backend, __ATOMIC_RELAXED);
+  }
+  return backend;
+}
+
+int crypto_set_backend(enum CryptoBackend backend) {
+  if (!crypto_backend_supported(backend))
+    return -1;
+  __atomic_store_n(&crypto_backend, backend, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void crypto_init(struct CryptoCtx *ctx, const unsigned char *key) {
   unsigned char key_be[16];
-  size_t i;
 
   memcpy(key_be, key, 16);
   convert_to_big_endian(key_be, 16);
 
-  AES_init_ctx(&ctx, key_be);
+  ctx->backend = crypto_get_backend();
+  if (ctx->backend == cryptoPORTABLE)
+    AES_init_ctx(&ctx->aes, key_be);
+  else
+    aesni_init(&ctx->aesni, key_be);
+}
 
-  convert_to_big_endian(data, length);
+/*
+ * ECB over whole 16 byte blocks. With swap each 32 bit word is converted
+ * to big endian before the cipher and back after it, block by block.
+ */
+static void crypto_ecb(const struct CryptoCtx *ctx, unsigned char *data, size_t blocks,
+                       int encrypt, int swap) {
+  size_t i;
 
-  for (i = 0; i < length; i += 16) {
-    AES_ECB_encrypt(&ctx, data+i);
+  switch (ctx->backend) {
+  case cryptoVAES:
+    if (encrypt)
+      vaes_ecb_encrypt(&ctx->aesni, data, blocks, swap);
+    else
+      vaes_ecb_decrypt(&ctx->aesni, data, blocks, swap);
+    break;
+  case cryptoAESNI:
+    if (encrypt)
+      aesni_ecb_encrypt(&ctx->aesni, data, blocks, swap);
+    else
+      aesni_ecb_decrypt(&ctx->aesni, data, blocks, swap);
+    break;
+  default:
+    for (i = 0; i < blocks; i++, data += 16) {
+      if (swap)
+        convert_to_big_endian(data, 16);
+      if (encrypt)
+        AES_ECB_encrypt(&ctx->aes, data);
+      else
+        AES_ECB_decrypt(&ctx->aes, data);
+      if (swap)
+        convert_to_big_endian(data, 16);
+    }
+    break;
   }
-  convert_to_big_endian(data, length);
 }
 
-void my_decrypt(unsigned char *key, unsigned char *data, unsigned int length) {
-  struct AES_ctx ctx;
-  unsigned char key_be[16];
-  size_t i;
+/*
+ * A partial last block only has the words up to length swapped, the rest
+ * of the block goes through the cipher as it is. Keep doing the same.
+ */
+static void crypto_tail(const struct CryptoCtx *ctx, unsigned char *data, unsigned int tail,
+                        int encrypt) {
+  convert_to_big_endian(data, tail);
+  crypto_ecb(ctx, data, 1, encrypt, 0);
+  convert_to_big_endian(data, tail);
+}
 
-  memcpy(key_be, key, 16);
-  convert_to_big_endian(key_be, 16);
+static void crypto_run(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length,
+                       int encrypt) {
+  unsigned int full = length / 16, tail = length % 16;
+
+  crypto_ecb(ctx, data, full, encrypt, 1);
+  if (tail)
+    crypto_tail(ctx, data + full * 16, tail, encrypt);
+}
+
+static uint32_t crypto_sum_c(const uint8_t *data, size_t length) {
+  uint32_t sum = 0;
 
-  AES_init_ctx(&ctx, key_be);
+  while (length--)
+    sum += *data++;
+  return sum;
+}
 
-  convert_to_big_endian(data, length);
+uint32_t crypto_sum_bytes(const unsigned char *data, size_t length) {
+  uint32_t (*sum)(const uint8_t *, size_t) = __atomic_load_n(&crypto_sum_impl, __ATOMIC_RELAXED);
 
-  for (i = 0; i < length; i += 16) {
-    AES_ECB_decrypt(&ctx, data+i);
+  if (!sum) {
+    sum = crypto_sum_c;
+    if (avx2_supported())
+      sum = avx2_sum_bytes;
+    else if (sse2_supported())
+      sum = sse2_sum_bytes;
+    __atomic_store_n(&crypto_sum_impl, sum, __ATOMIC_RELAXED);
   }
-  convert_to_big_endian(data, length);
+  return sum(data, length);
+}
+
+void crypto_encrypt(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length) {
+  crypto_run(ctx, data, length, 1);
+}
+
+/*
+ * The AES-NI and VAES kernels add up each block as they load it, so the
+ * plaintext is only read once. tiny-AES-c has no such hook, the separate
+ * sum pass at least leaves the chunk in the cache for the cipher.
+ */
+uint32_t crypto_encrypt_sum(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length) {
+  unsigned int full = length / 16, tail = length % 16;
+  uint32_t sum;
+
+  switch (ctx->backend) {
+  case cryptoVAES:
+    sum = vaes_ecb_encrypt_sum(&ctx->aesni, data, full, 1);
+    break;
+  case cryptoAESNI:
+    sum = aesni_ecb_encrypt_sum(&ctx->aesni, data, full, 1);
+    break;
+  default:
+    sum = crypto_sum_bytes(data, full * 16);
+    crypto_ecb(ctx, data, full, 1, 1);
+    break;
+  }
+  if (tail) {
+    data += full * 16;
+    sum += crypto_sum_bytes(data, tail);
+    crypto_tail(ctx, data, tail, 1);
+  }
+  return sum;
+}
+
+void crypto_decrypt(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length) {
+  crypto_run(ctx, data, length, 0);
+}
+
+struct CryptoSegments {
+  const struct CryptoCtx *ctx;
+  unsigned char *data;
+  unsigned int length;
+};
+
+static void crypto_decrypt_segment(void *arg, unsigned int index) {
+  struct CryptoSegments *job = arg;
+  unsigned int offset = index * CRYPTO_SEGMENT_SIZE;
+  unsigned int len = job->length - offset;
+
+  if (len > CRYPTO_SEGMENT_SIZE)
+    len = CRYPTO_SEGMENT_SIZE;
+  crypto_decrypt(job->ctx, job->data + offset, len);
+}
+
+/*
+ * Decrypts an image segment by segment on up to threads threads (0 for
+ * one per CPU). The segments do not overlap, so the result is the same
+ * as decrypting them in order.
+ */
+void crypto_decrypt_segments(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length,
+                             unsigned int threads) {
+  struct CryptoSegments job = {ctx, data, length};
+
+  parallel_for((length + CRYPTO_SEGMENT_SIZE - 1) / CRYPTO_SEGMENT_SIZE, threads,
+               crypto_decrypt_segment, &job);
+}
+
+void my_encrypt(unsigned char *key, unsigned char *data, unsigned int length) {
+  struct CryptoCtx ctx;
+
+  crypto_init(&ctx, key);
+  crypto_encrypt(&ctx, data, length);
+}
+
+void my_decrypt(unsigned char *key, unsigned char *data, unsigned int length) {
+  struct CryptoCtx ctx;
+
+  crypto_init(&ctx, key);
+  crypto_decrypt(&ctx, data, length);
 }
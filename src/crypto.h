@@ -19,5 +19,52 @@
   OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#ifndef _CRYPTO_H
+#define _CRYPTO_H
+
+#include "../tiny-AES-c/aes.h"
+#include "crypto_aesni.h"
+
+/* AES implementations, the fastest one the CPU supports is used by default */
+enum CryptoBackend {
+  cryptoPORTABLE = 0,
+  cryptoAESNI,
+  cryptoVAES,
+  cryptoCOUNT
+};
+
+extern const char *crypto_backend_names[];
+
+int crypto_backend_supported(enum CryptoBackend backend);
+enum CryptoBackend crypto_get_backend(void);
+int crypto_set_backend(enum CryptoBackend backend);
+
+/* Key schedule of one key, expanded once by crypto_init() for the current backend */
+struct CryptoCtx {
+  enum CryptoBackend backend;
+  struct AES_ctx aes;
+  struct AESNIKeys aesni;
+};
+
+void crypto_init(struct CryptoCtx *ctx, const unsigned char *key);
+void crypto_encrypt(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length);
+void crypto_decrypt(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length);
+
+/* Sum of the bytes modulo 2^32, with SSE2 or AVX2 when the CPU has them */
+uint32_t crypto_sum_bytes(const unsigned char *data, size_t length);
+/* crypto_encrypt() that also returns crypto_sum_bytes() of the plaintext */
+uint32_t crypto_encrypt_sum(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length);
+
+/* STLinkUpgrade images are encrypted in independent segments of this size */
+#define CRYPTO_SEGMENT_SIZE 0xC00
+
+void crypto_decrypt_segments(const struct CryptoCtx *ctx, unsigned char *data, unsigned int length,
+                             unsigned int threads);
+
+/* Swaps every 32 bit word of array to big endian, length is rounded up to a word */
+void convert_to_big_endian(unsigned char *array, unsigned int length);
+
 void my_encrypt(unsigned char *key, unsigned char *data, unsigned int length);
 void my_decrypt(unsigned char *key, unsigned char *data, unsigned int length);
+
+#endif //_CRYPTO_H
@@ -0,0 +1,350 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * AES-128 ECB with the AES-NI and VAES instructions. The word byte swap
+ * of the firmware format is done with pshufb on the way in and out of
+ * the registers, so data is read and written once. Each function is
+ * compiled for its instruction set with a target attribute, so the file
+ * builds without -maes and the caller picks a backend at runtime.
+ *
+ * The byte sums behind the DFU checksum are here too, with psadbw against
+ * zero, either on their own or while the blocks are loaded for encryption.
+ */
+
+#include "crypto_aesni.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,ssse3")))
+#define VAES_TARGET  __attribute__((target("vaes,avx2,aes")))
+#define SSE2_TARGET  __attribute__((target("sse2")))
+#define AVX2_TARGET  __attribute__((target("avx2")))
+/* Kernel bodies shared by the plain and the summing entry points */
+#define AESNI_INLINE static inline __attribute__((always_inline))
+
+/* Blocks in flight per iteration, enough to hide the aesenc latency */
+#define AESNI_LANES 8
+
+static int cpu_os_avx(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  /* OSXSAVE and AVX, then the OS must save the XMM and YMM state */
+  if ((ecx & (1 << 27 | 1 << 28)) != (1 << 27 | 1 << 28))
+    return 0;
+  __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return (eax & 0x6) == 0x6;
+}
+
+int aesni_supported(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  /* pshufb swaps the words, every AES-NI CPU has SSSE3 but check anyway */
+  return (ecx & bit_AES) && (ecx & bit_SSSE3);
+}
+
+int vaes_supported(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!aesni_supported() || !cpu_os_avx())
+    return 0;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+  /* AVX2 in EBX bit 5, VAES in ECX bit 9 */
+  return (ebx & (1 << 5)) && (ecx & (1 << 9));
+}
+
+int sse2_supported(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (edx & bit_SSE2) != 0;
+}
+
+int avx2_supported(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!cpu_os_avx())
+    return 0;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (ebx & (1 << 5)) != 0;
+}
+
+/* Adds the two 64 bit psadbw lanes, without the x86-64 only movq */
+SSE2_TARGET AESNI_INLINE uint64_t sum_lanes(__m128i acc) {
+  uint64_t lanes[2];
+
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1];
+}
+
+AESNI_INLINE uint64_t sum_tail(const uint8_t *data, size_t len) {
+  uint64_t sum = 0;
+
+  while (len--)
+    sum += *data++;
+  return sum;
+}
+
+SSE2_TARGET uint32_t sse2_sum_bytes(const uint8_t *data, size_t len) {
+  __m128i zero = _mm_setzero_si128(), acc0 = zero, acc1 = zero;
+
+  for (; len >= 32; len -= 32, data += 32) {
+    acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)data), zero));
+    acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)data + 1), zero));
+  }
+  if (len >= 16) {
+    acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)data), zero));
+    len -= 16;
+    data += 16;
+  }
+  return sum_lanes(_mm_add_epi64(acc0, acc1)) + sum_tail(data, len);
+}
+
+/* The tail stays in VEX code, calling the SSE2 version would pay for the AVX to SSE transition */
+AVX2_TARGET uint32_t avx2_sum_bytes(const uint8_t *data, size_t len) {
+  __m256i zero = _mm256_setzero_si256(), acc0 = zero, acc1 = zero;
+  __m128i acc;
+
+  for (; len >= 64; len -= 64, data += 64) {
+    acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)data), zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)data + 1), zero));
+  }
+  if (len >= 32) {
+    acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)data), zero));
+    len -= 32;
+    data += 32;
+  }
+  acc0 = _mm256_add_epi64(acc0, acc1);
+  acc = _mm_add_epi64(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+  if (len >= 16) {
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)data), _mm_setzero_si128()));
+    len -= 16;
+    data += 16;
+  }
+  return sum_lanes(acc) + sum_tail(data, len);
+}
+
+/* pshufb control reversing the bytes of each 32 bit word, or leaving them */
+AESNI_TARGET static __m128i aesni_swap_mask(int swap) {
+  if (swap)
+    return _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  return _mm_set_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+}
+
+AESNI_TARGET static __m128i aesni_key_step(__m128i key, __m128i assist) {
+  assist = _mm_shuffle_epi32(assist, 0xff);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, assist);
+}
+
+#define AESNI_KEY_ROUND(rk, i, rcon) \
+  rk[i] = aesni_key_step(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+
+AESNI_TARGET void aesni_init(struct AESNIKeys *keys, const uint8_t *key) {
+  __m128i rk[11];
+  int i;
+
+  rk[0] = _mm_loadu_si128((const __m128i *)key);
+  AESNI_KEY_ROUND(rk, 1, 0x01);
+  AESNI_KEY_ROUND(rk, 2, 0x02);
+  AESNI_KEY_ROUND(rk, 3, 0x04);
+  AESNI_KEY_ROUND(rk, 4, 0x08);
+  AESNI_KEY_ROUND(rk, 5, 0x10);
+  AESNI_KEY_ROUND(rk, 6, 0x20);
+  AESNI_KEY_ROUND(rk, 7, 0x40);
+  AESNI_KEY_ROUND(rk, 8, 0x80);
+  AESNI_KEY_ROUND(rk, 9, 0x1b);
+  AESNI_KEY_ROUND(rk, 10, 0x36);
+
+  for (i = 0; i < 11; i++)
+    _mm_storeu_si128((__m128i *)keys->enc[i], rk[i]);
+  _mm_storeu_si128((__m128i *)keys->dec[0], rk[10]);
+  for (i = 1; i < 10; i++)
+    _mm_storeu_si128((__m128i *)keys->dec[i], _mm_aesimc_si128(rk[10 - i]));
+  _mm_storeu_si128((__m128i *)keys->dec[10], rk[0]);
+}
+
+/* With sum the plaintext is also added up with psadbw as each block is loaded */
+AESNI_TARGET AESNI_INLINE uint64_t aesni_encrypt_blocks(const struct AESNIKeys *keys, uint8_t *data,
+                                                        size_t blocks, int swap, int sum) {
+  __m128i rk[11], b[AESNI_LANES], mask = aesni_swap_mask(swap);
+  __m128i zero = _mm_setzero_si128(), acc = zero;
+  int i, r;
+
+  for (r = 0; r < 11; r++)
+    rk[r] = _mm_loadu_si128((const __m128i *)keys->enc[r]);
+
+  for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES, data += AESNI_LANES * 16) {
+    for (i = 0; i < AESNI_LANES; i++) {
+      b[i] = _mm_loadu_si128((const __m128i *)data + i);
+      if (sum)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(b[i], zero));
+      b[i] = _mm_xor_si128(_mm_shuffle_epi8(b[i], mask), rk[0]);
+    }
+    for (r = 1; r < 10; r++)
+      for (i = 0; i < AESNI_LANES; i++)
+        b[i] = _mm_aesenc_si128(b[i], rk[r]);
+    for (i = 0; i < AESNI_LANES; i++)
+      _mm_storeu_si128((__m128i *)data + i, _mm_shuffle_epi8(_mm_aesenclast_si128(b[i], rk[10]), mask));
+  }
+
+  for (; blocks; blocks--, data += 16) {
+    b[0] = _mm_loadu_si128((const __m128i *)data);
+    if (sum)
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(b[0], zero));
+    b[0] = _mm_xor_si128(_mm_shuffle_epi8(b[0], mask), rk[0]);
+    for (r = 1; r < 10; r++)
+      b[0] = _mm_aesenc_si128(b[0], rk[r]);
+    _mm_storeu_si128((__m128i *)data, _mm_shuffle_epi8(_mm_aesenclast_si128(b[0], rk[10]), mask));
+  }
+
+  return sum ? sum_lanes(acc) : 0;
+}
+
+AESNI_TARGET void aesni_ecb_encrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) {
+  aesni_encrypt_blocks(keys, data, blocks, swap, 0);
+}
+
+AESNI_TARGET uint32_t aesni_ecb_encrypt_sum(const struct AESNIKeys *keys, uint8_t *data, size_t blocks,
+                                            int swap) {
+  return aesni_encrypt_blocks(keys, data, blocks, swap, 1);
+}
+
+AESNI_TARGET void aesni_ecb_decrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) {
+  __m128i rk[11], b[AESNI_LANES], mask = aesni_swap_mask(swap);
+  int i, r;
+
+  for (r = 0; r < 11; r++)
+    rk[r] = _mm_loadu_si128((const __m128i *)keys->dec[r]);
+
+  for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES, data += AESNI_LANES * 16) {
+    for (i = 0; i < AESNI_LANES; i++)
+      b[i] = _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + i), mask), rk[0]);
+    for (r = 1; r < 10; r++)
+      for (i = 0; i < AESNI_LANES; i++)
+        b[i] = _mm_aesdec_si128(b[i], rk[r]);
+    for (i = 0; i < AESNI_LANES; i++)
+      _mm_storeu_si128((__m128i *)data + i, _mm_shuffle_epi8(_mm_aesdeclast_si128(b[i], rk[10]), mask));
+  }
+
+  for (; blocks; blocks--, data += 16) {
+    b[0] = _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), mask), rk[0]);
+    for (r = 1; r < 10; r++)
+      b[0] = _mm_aesdec_si128(b[0], rk[r]);
+    _mm_storeu_si128((__m128i *)data, _mm_shuffle_epi8(_mm_aesdeclast_si128(b[0], rk[10]), mask));
+  }
+}
+
+/* Two blocks per YMM register, AESNI_LANES blocks per iteration */
+VAES_TARGET AESNI_INLINE uint64_t vaes_encrypt_blocks(const struct AESNIKeys *keys, uint8_t *data,
+                                                      size_t blocks, int swap, int sum) {
+  __m256i rk[11], b[AESNI_LANES / 2];
+  __m256i mask = _mm256_broadcastsi128_si256(aesni_swap_mask(swap));
+  __m256i zero = _mm256_setzero_si256(), acc = zero;
+  int i, r;
+
+  for (r = 0; r < 11; r++)
+    rk[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)keys->enc[r]));
+
+  for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES, data += AESNI_LANES * 16) {
+    for (i = 0; i < AESNI_LANES / 2; i++) {
+      b[i] = _mm256_loadu_si256((const __m256i *)data + i);
+      if (sum)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(b[i], zero));
+      b[i] = _mm256_xor_si256(_mm256_shuffle_epi8(b[i], mask), rk[0]);
+    }
+    for (r = 1; r < 10; r++)
+      for (i = 0; i < AESNI_LANES / 2; i++)
+        b[i] = _mm256_aesenc_epi128(b[i], rk[r]);
+    for (i = 0; i < AESNI_LANES / 2; i++)
+      _mm256_storeu_si256((__m256i *)data + i, _mm256_shuffle_epi8(_mm256_aesenclast_epi128(b[i], rk[10]), mask));
+  }
+
+  if (!sum) {
+    if (blocks)
+      aesni_ecb_encrypt(keys, data, blocks, swap);
+    return 0;
+  }
+  return sum_lanes(_mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)))
+         + (blocks ? aesni_ecb_encrypt_sum(keys, data, blocks, swap) : 0);
+}
+
+VAES_TARGET void vaes_ecb_encrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) {
+  vaes_encrypt_blocks(keys, data, blocks, swap, 0);
+}
+
+VAES_TARGET uint32_t vaes_ecb_encrypt_sum(const struct AESNIKeys *keys, uint8_t *data, size_t blocks,
+                                          int swap) {
+  return vaes_encrypt_blocks(keys, data, blocks, swap, 1);
+}
+
+VAES_TARGET void vaes_ecb_decrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) {
+  __m256i rk[11], b[AESNI_LANES / 2];
+  __m256i mask = _mm256_broadcastsi128_si256(aesni_swap_mask(swap));
+  int i, r;
+
+  for (r = 0; r < 11; r++)
+    rk[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)keys->dec[r]));
+
+  for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES, data += AESNI_LANES * 16) {
+    for (i = 0; i < AESNI_LANES / 2; i++)
+      b[i] = _mm256_xor_si256(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)data + i), mask), rk[0]);
+    for (r = 1; r < 10; r++)
+      for (i = 0; i < AESNI_LANES / 2; i++)
+        b[i] = _mm256_aesdec_epi128(b[i], rk[r]);
+    for (i = 0; i < AESNI_LANES / 2; i++)
+      _mm256_storeu_si256((__m256i *)data + i, _mm256_shuffle_epi8(_mm256_aesdeclast_epi128(b[i], rk[10]), mask));
+  }
+
+  if (blocks)
+    aesni_ecb_decrypt(keys, data, blocks, swap);
+}
+
+#else
+
+/* Not an x86 CPU, crypto.c always uses tiny-AES-c and sums bytes in C */
+int aesni_supported(void) { return 0; }
+int vaes_supported(void) { return 0; }
+int sse2_supported(void) { return 0; }
+int avx2_supported(void) { return 0; }
+void aesni_init(struct AESNIKeys *keys, const uint8_t *key) {}
+void aesni_ecb_encrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) {}
+void aesni_ecb_decrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) {}
+void vaes_ecb_encrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) {}
+void vaes_ecb_decrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) {}
+uint32_t aesni_ecb_encrypt_sum(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) { return 0; }
+uint32_t vaes_ecb_encrypt_sum(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap) { return 0; }
+uint32_t sse2_sum_bytes(const uint8_t *data, size_t len) { return 0; }
+uint32_t avx2_sum_bytes(const uint8_t *data, size_t len) { return 0; }
+
+#endif
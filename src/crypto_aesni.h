@@ -0,0 +1,57 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef _CRYPTO_AESNI_H
+#define _CRYPTO_AESNI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Expanded AES-128 round keys, decryption keys in equivalent inverse cipher order.
+ * They live in heap allocated STLinkInfo copies that malloc only aligns to 8
+ * bytes on some targets, so they are loaded without alignment requirements.
+ */
+struct AESNIKeys {
+  uint8_t enc[11][16];
+  uint8_t dec[11][16];
+};
+
+/* swap reverses the bytes of each 32 bit word before and after the cipher */
+int aesni_supported(void);
+int vaes_supported(void);
+int sse2_supported(void);
+int avx2_supported(void);
+
+void aesni_init(struct AESNIKeys *keys, const uint8_t *key);
+void aesni_ecb_encrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap);
+void aesni_ecb_decrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap);
+void vaes_ecb_encrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap);
+void vaes_ecb_decrypt(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap);
+
+/* Encrypt the same way and return the sum of the plaintext bytes, modulo 2^32 */
+uint32_t aesni_ecb_encrypt_sum(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap);
+uint32_t vaes_ecb_encrypt_sum(const struct AESNIKeys *keys, uint8_t *data, size_t blocks, int swap);
+
+/* Sum of len bytes modulo 2^32 */
+uint32_t sse2_sum_bytes(const uint8_t *data, size_t len);
+uint32_t avx2_sum_bytes(const uint8_t *data, size_t len);
+
+#endif //_CRYPTO_AESNI_H
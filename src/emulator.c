@@ -0,0 +1,563 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * ST-Link DFU bootloader emulator for --emulate. It covers the requests
+ * stlink-tool sends: the F1/F3/F5/F9 commands, the 0x08/0x09/0x0A
+ * queries and the DFU requests on the 0xF3 prefix, with the firmware key
+ * derived from the id like a real dongle. Flash is a plain array with
+ * NOR semantics, programming can only clear bits, and erases and writes
+ * keep the bootloader busy for the time the real part takes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+
+#ifndef min
+  #define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#define FLASH_BASE        0x08000000
+#define CONFIG_PAGE       0x08003C00
+
+/* STM32F103 of the V2 and V2-1: 1KB pages, 52.5us per 16 bit write */
+#define F1_PAGE_ERASE_US  20000
+#define F1_PROGRAM_US_KB  26900
+/* STM32F723 of the V3: 16/64/128KB sectors, 16us per 32 bit write */
+#define F7_PROGRAM_US_KB  4100
+/* SET_ADDRESS and requests rejected by the bootloader */
+#define COMMAND_US        100
+
+static const uint32_t f7_sector_start[] = {0x08000000, 0x08004000, 0x08008000, 0x0800C000,
+                                           0x08010000, 0x08020000, 0x08040000, 0x08060000,
+                                           0x08080000};
+#define F7_SECTOR_COUNT 8
+
+/* Typical erase time of an STM32F7 sector by size */
+static uint32_t emulator_sector_erase_us(uint32_t size) {
+  if (size <= 0x4000)
+    return 250000;
+  if (size <= 0x10000)
+    return 490000;
+  return 875000;
+}
+
+/* flash_size in KB, 0 for the part of the dongle. V3 flash keeps its sector layout whatever the size */
+int emulator_init(struct Emulator *emu, enum BlTypes bl_type, uint16_t flash_size, uint32_t serial) {
+  uint8_t key_data[20];
+  unsigned int i;
+
+  memset(emu, 0, sizeof(*emu));
+  emu->bl_type = bl_type;
+  emu->time_scale = 1.0;
+  emu->state = dfuIDLE;
+  emu->status = OK;
+
+  /* Same defaults as --dry_run */
+  switch (bl_type) {
+  case STLINK_BL_V2:
+    emu->pid = STLINK_PID;
+    emu->mode = 1;
+    emu->flash_size = 64;
+    emu->stlink_type = 'M';
+    emu->software_version = 2 << 12 | 37 << 6 | 7;
+    break;
+  case STLINK_BL_V21:
+    emu->pid = STLINK_PID;
+    emu->mode = 2;
+    emu->flash_size = 128;
+    emu->stlink_type = 'A';
+    emu->software_version = 2 << 12 | 37 << 6 | 26;
+    emu->hardware_version = 0x21000000;
+    break;
+  case STLINK_BL_V3:
+    emu->pid = STLINK_PIDV3_BL;
+    emu->mode = 3;
+    emu->flash_size = 255;
+    emu->stlink_type = 'F';
+    emu->software_version = 3 << 12 | 7 << 6 | 2;
+    emu->hardware_version = 0x30000000;
+    break;
+  default:
+    fprintf(stderr, "Unknown bootloader type %d\n", bl_type);
+    return -1;
+  }
+  if (flash_size)
+    emu->flash_size = flash_size;
+  if (bl_type == STLINK_BL_V3)
+    emu->flash_bytes = EMULATOR_FLASH_MAX;
+  else
+    emu->flash_bytes = (uint32_t)emu->flash_size << 10;
+  if (emu->flash_bytes > EMULATOR_FLASH_MAX) {
+    fprintf(stderr, "Emulated flash larger than %u KB\n", EMULATOR_FLASH_MAX >> 10);
+    return -1;
+  }
+
+  emu->flash = malloc(emu->flash_bytes);
+  if (!emu->flash) {
+    fprintf(stderr, "Not enough memory for the emulated flash\n");
+    return -1;
+  }
+  memset(emu->flash, 0xFF, emu->flash_bytes);
+
+  /* Unique id of the part, the serial keeps emulated dongles apart */
+  for (i = 0; i < sizeof(emu->id); i++) {
+    serial = serial * 1103515245 + 12345;
+    emu->id[i] = serial >> 16;
+  }
+
+  /* Firmware key from the flash size and the id, like the bootloader does */
+  memset(key_data, 0, sizeof(key_data));
+  key_data[0] = emu->flash_size & 0xFF;
+  key_data[1] = emu->flash_size >> 8;
+  memcpy(emu->firmware_key, key_data, 4);
+  memcpy(emu->firmware_key + 4, emu->id, 12);
+  my_encrypt((unsigned char*)"I am key, wawawa", emu->firmware_key, 16);
+  crypto_init(&emu->crypto, emu->firmware_key);
+
+  return 0;
+}
+
+void emulator_free(struct Emulator *emu) {
+  free(emu->flash);
+  emu->flash = NULL;
+}
+
+/* Starts from the flash content of a previous run, a shorter file leaves the rest erased */
+int emulator_load(struct Emulator *emu, const char *filename) {
+  FILE *file;
+  size_t len;
+
+  file = fopen(filename, "rb");
+  if (!file)
+    return 1;
+  len = fread(emu->flash, 1, emu->flash_bytes, file);
+  if (ferror(file)) {
+    fprintf(stderr, "Unable to read %s\n", filename);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  memset(emu->flash + len, 0xFF, emu->flash_bytes - len);
+
+  return 0;
+}
+
+/* Writes the whole flash, bootloader area included, offset 0 is 0x08000000 */
+int emulator_save(const struct Emulator *emu, const char *filename) {
+  FILE *file;
+
+  file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    return -1;
+  }
+  if (fwrite(emu->flash, 1, emu->flash_bytes, file) != emu->flash_bytes) {
+    fprintf(stderr, "Unable to write %s\n", filename);
+    fclose(file);
+    return -1;
+  }
+
+  return fclose(file) ? -1 : 0;
+}
+
+void emulator_report(const struct Emulator *emu) {
+  printf("Emulator: %u erases, %u writes, %llu bytes programmed%s\n", emu->erases, emu->writes,
+         (unsigned long long)emu->bytes_written, emu->exited ? ", left DFU" : "");
+}
+
+static uint32_t emulator_le32(const unsigned char *data) {
+  return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+/* Whether [address, address + len) is outside the bootloader and inside flash */
+static bool emulator_writable(const struct Emulator *emu, uint32_t address, uint32_t len) {
+  uint32_t app_start = (emu->bl_type == STLINK_BL_V3) ? 0x08020000 : 0x08004000;
+
+  if (address < FLASH_BASE || address + len > FLASH_BASE + emu->flash_bytes || address + len < address)
+    return false;
+  if (address >= CONFIG_PAGE && address + len <= CONFIG_PAGE + STLINK_PAGE_SIZE)
+    return true;
+  return address >= app_start;
+}
+
+static uint32_t emulator_erase_page(struct Emulator *emu, uint32_t address) {
+  address &= ~(STLINK_PAGE_SIZE - 1);
+  if (!emulator_writable(emu, address, STLINK_PAGE_SIZE)) {
+    emu->op_status = errTARGET;
+    return COMMAND_US;
+  }
+  memset(emu->flash + (address - FLASH_BASE), 0xFF, STLINK_PAGE_SIZE);
+  emu->erases++;
+  return F1_PAGE_ERASE_US;
+}
+
+static uint32_t emulator_erase_sector(struct Emulator *emu, uint32_t sector) {
+  uint32_t start, size;
+
+  if (emu->bl_type != STLINK_BL_V3 || sector >= F7_SECTOR_COUNT) {
+    emu->op_status = errTARGET;
+    return COMMAND_US;
+  }
+  start = f7_sector_start[sector];
+  size = f7_sector_start[sector + 1] - start;
+  if (!emulator_writable(emu, start, size)) {
+    emu->op_status = errTARGET;
+    return COMMAND_US;
+  }
+  memset(emu->flash + (start - FLASH_BASE), 0xFF, size);
+  emu->erases++;
+  return emulator_sector_erase_us(size);
+}
+
+/*
+ * Programs the decrypted payload. V2 bootloaders write block n at the
+ * address pointer + (n - 2) * chunk size, V3 ones at the address pointer.
+ */
+static uint32_t emulator_program(struct Emulator *emu, uint16_t block, uint16_t checksum) {
+  uint32_t address, i, sum = 0;
+  uint8_t *dest;
+
+  crypto_decrypt(&emu->crypto, emu->payload, emu->payload_len);
+  for (i = 0; i < emu->payload_len; i++)
+    sum += emu->payload[i];
+  if ((sum & 0xFFFF) != checksum) {
+    emu->op_status = errFILE;
+    return COMMAND_US;
+  }
+
+  address = emu->address;
+  if (emu->bl_type != STLINK_BL_V3)
+    address += (uint32_t)(block - 2) * STLINK_CHUNK_SIZE;
+  if (!emulator_writable(emu, address, emu->payload_len)) {
+    emu->op_status = errTARGET;
+    return COMMAND_US;
+  }
+
+  dest = emu->flash + (address - FLASH_BASE);
+  for (i = 0; i < emu->payload_len; i++) {
+    if ((dest[i] & emu->payload[i]) != emu->payload[i])
+      emu->op_status = errPROG;
+    dest[i] &= emu->payload[i];
+  }
+  emu->writes++;
+  emu->bytes_written += emu->payload_len;
+
+  return (uint32_t)(((uint64_t)emu->payload_len *
+                    (emu->bl_type == STLINK_BL_V3 ? F7_PROGRAM_US_KB : F1_PROGRAM_US_KB)) >> 10);
+}
+
+/* Runs the download received in the data stage, returns how long the bootloader stays busy */
+static uint32_t emulator_download(struct Emulator *emu) {
+  uint16_t block = emu->block, checksum = emu->checksum;
+
+  emu->op_status = OK;
+  if (block >= 2)
+    return emulator_program(emu, block, checksum);
+  if (block == 1 || emu->payload_len != 5) {
+    emu->op_status = errSTALLEDPKT;
+    return COMMAND_US;
+  }
+
+  switch (emu->payload[0]) {
+  case SET_ADDRESS_POINTER_COMMAND:
+    emu->address = emulator_le32(emu->payload + 1);
+    return COMMAND_US;
+  case ERASE_COMMAND:
+    return emulator_erase_page(emu, emulator_le32(emu->payload + 1));
+  case ERASE_SECTOR_COMMAND:
+    return emulator_erase_sector(emu, emu->payload[1]);
+  default:
+    emu->op_status = errSTALLEDPKT;
+    return COMMAND_US;
+  }
+}
+
+static void emulator_reply(struct Emulator *emu, const unsigned char *data, size_t len) {
+  memcpy(emu->response, data, len);
+  emu->response_len = len;
+}
+
+static void emulator_get_status(struct Emulator *emu) {
+  unsigned char data[6];
+  uint64_t now = stlink_time_us(), busy_us = 0;
+
+  if (emu->state == dfuDNLOAD_SYNC) {
+    /* The operation starts when the host asks for the status */
+    busy_us = emulator_download(emu) * emu->time_scale;
+    emu->busy_until_us = now + busy_us;
+    emu->state = dfuDNBUSY;
+  } else if (emu->state == dfuDNBUSY) {
+    if (now < emu->busy_until_us) {
+      busy_us = emu->busy_until_us - now;
+    } else if (emu->op_status != OK) {
+      emu->state = dfuERROR;
+      emu->status = emu->op_status;
+    } else {
+      emu->state = dfuDNLOAD_IDLE;
+    }
+  }
+
+  /* bwPollTimeout in ms, rounded up */
+  busy_us = (busy_us + 999) / 1000;
+  data[0] = emu->status;
+  data[1] = busy_us & 0xFF;
+  data[2] = (busy_us >> 8) & 0xFF;
+  data[3] = (busy_us >> 16) & 0xFF;
+  data[4] = emu->state;
+  data[5] = 0;
+  emulator_reply(emu, data, sizeof(data));
+}
+
+static void emulator_upload(struct Emulator *emu) {
+  uint16_t block = emu->request[2] | emu->request[3] << 8;
+  uint16_t len = emu->request[6] | emu->request[7] << 8;
+  uint32_t address = emu->address;
+
+  if (emu->bl_type != STLINK_BL_V3 && block >= 2)
+    address += (uint32_t)(block - 2) * STLINK_CHUNK_SIZE;
+  if (emu->state != dfuIDLE && emu->state != dfuUPLOAD_IDLE) {
+    emu->state = dfuERROR;
+    emu->status = errNOTDONE;
+    emu->stall = true;
+    return;
+  }
+  if (len > STLINK_CHUNK_SIZE || address < FLASH_BASE ||
+      address + len > FLASH_BASE + emu->flash_bytes) {
+    emu->state = dfuERROR;
+    emu->status = errADDRESS;
+    emu->stall = true;
+    return;
+  }
+  emulator_reply(emu, emu->flash + (address - FLASH_BASE), len);
+  emu->state = dfuUPLOAD_IDLE;
+}
+
+/* Requests behind the 0xF3 prefix */
+static void emulator_dfu_request(struct Emulator *emu) {
+  unsigned char data[0x40];
+  uint16_t len = emu->request[6] | emu->request[7] << 8;
+  uint8_t type;
+
+  switch (emu->request[1]) {
+  case DFU_DNLOAD:
+    /* A download while the last one is still busy or unpolled is a host bug */
+    if (emu->state != dfuIDLE && emu->state != dfuDNLOAD_IDLE) {
+      emu->state = dfuERROR;
+      emu->status = errNOTDONE;
+      emu->stall = true;
+      break;
+    }
+    if (len == 0 || len > STLINK_CHUNK_SIZE) {
+      emu->state = dfuERROR;
+      emu->status = errSTALLEDPKT;
+      emu->stall = true;
+      break;
+    }
+    emu->block = emu->request[2] | emu->request[3] << 8;
+    emu->checksum = emu->request[4] | emu->request[5] << 8;
+    emu->payload_len = len;
+    emu->data_stage = true;
+    break;
+  case DFU_UPLOAD:
+    emulator_upload(emu);
+    break;
+  case DFU_GETSTATUS:
+    emulator_get_status(emu);
+    break;
+  case DFU_CLRSTATUS:
+  case DFU_ABORT:
+    emu->state = dfuIDLE;
+    emu->status = OK;
+    break;
+  case DFU_GETSTATE:
+    data[0] = emu->state;
+    emulator_reply(emu, data, 1);
+    break;
+  case DFU_EXIT:
+    emu->exited = true;
+    break;
+  case 0x08:
+    /* Flash size, ST-Link type (the one written to the config page if any) and id */
+    memset(data, 0, 20);
+    data[0] = emu->flash_size & 0xFF;
+    data[1] = emu->flash_size >> 8;
+    type = emu->flash[CONFIG_PAGE + 0x20 - FLASH_BASE];
+    data[4] = (type != 0xFF) ? type : (uint8_t)emu->stlink_type;
+    memcpy(data + 8, emu->id, 12);
+    emulator_reply(emu, data, 20);
+    break;
+  case 0x09:
+    /* Device config, only V2-1 and V3 bootloaders have it */
+    if (emu->mode < 2) {
+      emu->stall = true;
+      break;
+    }
+    emulator_reply(emu, emu->flash + (CONFIG_PAGE + 0x30 - FLASH_BASE), 0x40);
+    break;
+  case 0x0A:
+    if (emu->mode < 2) {
+      emu->stall = true;
+      break;
+    }
+    memset(data, 0, 16);
+    data[0] = emu->hardware_version & 0xFF;
+    data[1] = (emu->hardware_version >> 8) & 0xFF;
+    data[2] = (emu->hardware_version >> 16) & 0xFF;
+    data[3] = emu->hardware_version >> 24;
+    emulator_reply(emu, data, 16);
+    break;
+  default:
+    emu->stall = true;
+    break;
+  }
+}
+
+static int emulator_out(struct Emulator *emu, const unsigned char *data, int length) {
+  const uint8_t *version = emu->flash + (CONFIG_PAGE + 0x3FE - FLASH_BASE);
+  unsigned char reply[6];
+
+  if (emu->data_stage) {
+    emu->data_stage = false;
+    if ((size_t)length != emu->payload_len) {
+      emu->state = dfuERROR;
+      emu->status = errSTALLEDPKT;
+      return LIBUSB_ERROR_PIPE;
+    }
+    memcpy(emu->payload, data, length);
+    emu->state = dfuDNLOAD_SYNC;
+    return 0;
+  }
+
+  if (length != 16)
+    return LIBUSB_ERROR_PIPE;
+  memcpy(emu->request, data, 16);
+  emu->response_len = 0;
+  emu->stall = false;
+
+  switch (data[0]) {
+  case ST_DFU_INFO:
+    /* Software version, big endian, the one written to the config page if any */
+    memset(reply, 0, sizeof(reply));
+    if (version[0] != 0xFF || version[1] != 0xFF) {
+      reply[0] = version[0];
+      reply[1] = version[1];
+    } else {
+      reply[0] = emu->software_version >> 8;
+      reply[1] = emu->software_version & 0xFF;
+    }
+    reply[2] = STLINK_VID & 0xFF;
+    reply[3] = STLINK_VID >> 8;
+    reply[4] = emu->pid & 0xFF;
+    reply[5] = emu->pid >> 8;
+    emulator_reply(emu, reply, 6);
+    break;
+  case ST_DFU_MAGIC:
+    emulator_dfu_request(emu);
+    break;
+  case 0xF5:
+    /* Current mode */
+    reply[0] = 0;
+    reply[1] = emu->mode;
+    emulator_reply(emu, reply, 2);
+    break;
+  case 0xF9:
+    /* Switch to DFU, already there */
+    if (!data[1]) {
+      reply[0] = 0x80;
+      reply[1] = 0;
+      emulator_reply(emu, reply, 2);
+    }
+    break;
+  default:
+    emu->stall = true;
+    break;
+  }
+
+  return 0;
+}
+
+static int emulator_in(struct Emulator *emu, unsigned char *data, int length, int *transferred) {
+  if (emu->stall) {
+    emu->stall = false;
+    return LIBUSB_ERROR_PIPE;
+  }
+  if (!emu->response_len)
+    return LIBUSB_ERROR_TIMEOUT;
+  if ((size_t)length < emu->response_len) {
+    emu->response_len = 0;
+    return LIBUSB_ERROR_OVERFLOW;
+  }
+  memcpy(data, emu->response, emu->response_len);
+  *transferred = emu->response_len;
+  emu->response_len = 0;
+
+  return 0;
+}
+
+int emulator_bulk_transfer(struct Emulator *emu, unsigned char endpoint,
+                           unsigned char *data, int length, int *transferred) {
+  int res;
+
+  *transferred = 0;
+  if (emu->exited)
+    return LIBUSB_ERROR_NO_DEVICE;
+  if (endpoint & LIBUSB_ENDPOINT_IN)
+    return emulator_in(emu, data, length, transferred);
+  res = emulator_out(emu, data, length);
+  if (!res)
+    *transferred = length;
+  return res;
+}
+
+/* Runs the transfer right away and calls its callback, like libusb would from the event loop */
+int emulator_submit_transfer(struct Emulator *emu, struct libusb_transfer *transfer) {
+  int res;
+
+  res = emulator_bulk_transfer(emu, transfer->endpoint, transfer->buffer, transfer->length,
+                               &transfer->actual_length);
+  switch (res) {
+  case 0:
+    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    break;
+  case LIBUSB_ERROR_PIPE:
+    transfer->status = LIBUSB_TRANSFER_STALL;
+    break;
+  case LIBUSB_ERROR_TIMEOUT:
+    transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+    break;
+  case LIBUSB_ERROR_NO_DEVICE:
+    transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+    break;
+  case LIBUSB_ERROR_OVERFLOW:
+    transfer->status = LIBUSB_TRANSFER_OVERFLOW;
+    break;
+  default:
+    transfer->status = LIBUSB_TRANSFER_ERROR;
+    break;
+  }
+  transfer->callback(transfer);
+
+  return 0;
+}
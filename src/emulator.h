@@ -0,0 +1,90 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef _EMULATOR_H
+#define _EMULATOR_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+#include "stlink.h"
+#include "crypto.h"
+
+/* Flash of the largest emulated part, the STM32F723 of the V3 */
+#define EMULATOR_FLASH_MAX 0x80000
+
+/*
+ * Software model of an ST-Link DFU bootloader, see --emulate. It answers
+ * the 16 byte requests the tool sends on the OUT endpoint and queues the
+ * reply for the next read of the IN endpoint.
+ */
+struct Emulator {
+  enum BlTypes bl_type;
+  uint16_t pid;
+  uint16_t software_version;
+  uint16_t flash_size;
+  uint8_t mode;
+  char stlink_type;
+  uint32_t hardware_version;
+  uint8_t id[12];
+  uint8_t firmware_key[16];
+  struct CryptoCtx crypto;
+
+  uint8_t *flash;
+  uint32_t flash_bytes;
+
+  /* DFU state machine */
+  enum DeviceState state;
+  enum DeviceStatus status;
+  uint32_t address;
+  unsigned char request[16];
+  /* Pending DNLOAD, run by the next GETSTATUS */
+  bool data_stage;
+  uint16_t block;
+  uint16_t checksum;
+  unsigned char payload[STLINK_CHUNK_SIZE];
+  size_t payload_len;
+  enum DeviceStatus op_status;
+  uint64_t busy_until_us;
+  unsigned char response[STLINK_CHUNK_SIZE];
+  size_t response_len;
+  bool stall;
+  bool exited;
+
+  /* Erase and program times are multiplied by time_scale, 0 makes them instant */
+  double time_scale;
+
+  unsigned int erases;
+  unsigned int writes;
+  uint64_t bytes_written;
+};
+
+int emulator_init(struct Emulator *emu, enum BlTypes bl_type, uint16_t flash_size, uint32_t serial);
+void emulator_free(struct Emulator *emu);
+int emulator_load(struct Emulator *emu, const char *filename);
+int emulator_save(const struct Emulator *emu, const char *filename);
+void emulator_report(const struct Emulator *emu);
+
+/* libusb_bulk_transfer() and libusb_submit_transfer() against the emulator */
+int emulator_bulk_transfer(struct Emulator *emu, unsigned char endpoint,
+                           unsigned char *data, int length, int *transferred);
+int emulator_submit_transfer(struct Emulator *emu, struct libusb_transfer *transfer);
+
+#endif //_EMULATOR_H
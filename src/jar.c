@@ -0,0 +1,323 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Just enough of the zip format to pull firmware files out of
+ * STLinkUpgrade.jar: the central directory is read into an index of the
+ * .bin entries, which is cached next to the jar as <jar>.idx and reused
+ * while the jar keeps the same size and modification time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef WINDOWS
+  #include <windows.h>
+  #include <process.h>
+  #define getpid _getpid
+#else
+  #include <unistd.h>
+#endif
+
+#include "jar.h"
+
+#define ZIP_EOCD_SIG          0x06054b50
+#define ZIP_EOCD_SIZE         22
+#define ZIP_CENTRAL_SIG       0x02014b50
+#define ZIP_CENTRAL_SIZE      46
+#define ZIP_LOCAL_SIG         0x04034b50
+#define ZIP_LOCAL_SIZE        30
+#define ZIP_MAX_COMMENT       0xFFFF
+
+#define ZIP_STORED            0
+#define ZIP_DEFLATED          8
+
+#define JAR_INDEX_MAGIC       "stlink-tool jar index 1"
+
+static uint16_t jar_le16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t jar_le32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int jar_add(struct JarIndex *index, const struct JarEntry *entry) {
+  struct JarEntry *entries;
+
+  entries = realloc(index->entries, (index->count + 1) * sizeof(*entries));
+  if (!entries)
+    return -1;
+  index->entries = entries;
+  index->entries[index->count++] = *entry;
+  return 0;
+}
+
+static int jar_scan(const uint8_t *jar, size_t jar_size, struct JarIndex *index) {
+  const uint8_t *eocd = NULL, *p, *end;
+  struct JarEntry entry;
+  uint32_t cd_offset, cd_size;
+  unsigned int entries, i;
+  size_t pos, name_len;
+
+  if (jar_size < ZIP_EOCD_SIZE)
+    return -1;
+  /* The end of central directory record is followed by a comment of up to 64KB */
+  for (pos = jar_size - ZIP_EOCD_SIZE + 1; pos-- > 0 && jar_size - pos <= ZIP_EOCD_SIZE + ZIP_MAX_COMMENT;) {
+    if (jar_le32(jar + pos) == ZIP_EOCD_SIG) {
+      eocd = jar + pos;
+      break;
+    }
+  }
+  if (!eocd)
+    return -1;
+
+  entries = jar_le16(eocd + 10);
+  cd_size = jar_le32(eocd + 12);
+  cd_offset = jar_le32(eocd + 16);
+  if ((uint64_t)cd_offset + cd_size > jar_size)
+    return -1;
+
+  p = jar + cd_offset;
+  end = p + cd_size;
+  for (i = 0; i < entries; i++) {
+    if (end - p < ZIP_CENTRAL_SIZE || jar_le32(p) != ZIP_CENTRAL_SIG)
+      return -1;
+    name_len = jar_le16(p + 28);
+    if ((size_t)(end - p) < ZIP_CENTRAL_SIZE + name_len)
+      return -1;
+
+    if (name_len > 4 && name_len < JAR_NAME_MAX &&
+        !memcmp(p + ZIP_CENTRAL_SIZE + name_len - 4, ".bin", 4)) {
+      memset(&entry, 0, sizeof(entry));
+      memcpy(entry.name, p + ZIP_CENTRAL_SIZE, name_len);
+      entry.method = jar_le16(p + 10);
+      entry.crc = jar_le32(p + 16);
+      entry.compressed_size = jar_le32(p + 20);
+      entry.size = jar_le32(p + 24);
+      entry.header_offset = jar_le32(p + 42);
+      if (jar_add(index, &entry))
+        return -1;
+    }
+    p += ZIP_CENTRAL_SIZE + name_len + jar_le16(p + 30) + jar_le16(p + 32);
+  }
+
+  return 0;
+}
+
+static int jar_stat(const char *jar_path, unsigned long long *size, long long *mtime) {
+  struct stat jar_stat;
+
+  if (stat(jar_path, &jar_stat))
+    return -1;
+  *size = jar_stat.st_size;
+  *mtime = jar_stat.st_mtime;
+  return 0;
+}
+
+static int jar_cache_read(const char *cache_path, unsigned long long size, long long mtime,
+                          struct JarIndex *index) {
+  char line[JAR_NAME_MAX + 64], magic[sizeof(JAR_INDEX_MAGIC)];
+  unsigned long long cache_size;
+  long long cache_mtime;
+  unsigned int method;
+  struct JarEntry entry;
+  FILE *fd;
+  int n;
+
+  fd = fopen(cache_path, "r");
+  if (fd == NULL)
+    return -1;
+  if (!fgets(magic, sizeof(magic), fd) || strcmp(magic, JAR_INDEX_MAGIC) ||
+      fscanf(fd, " %llu %lld\n", &cache_size, &cache_mtime) != 2 ||
+      cache_size != size || cache_mtime != mtime) {
+    fclose(fd);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fd)) {
+    memset(&entry, 0, sizeof(entry));
+    if (sscanf(line, "%u %u %u %u %x %n", &entry.header_offset, &method, &entry.compressed_size,
+               &entry.size, &entry.crc, &n) != 5)
+      continue;
+    entry.method = method;
+    line[strcspn(line, "\r\n")] = '\0';
+    strncpy(entry.name, line + n, JAR_NAME_MAX - 1);
+    if (jar_add(index, &entry)) {
+      fclose(fd);
+      return -1;
+    }
+  }
+  fclose(fd);
+
+  return 0;
+}
+
+/*
+ * The cache is written next to it and renamed over the old one, so that
+ * other stlink-tool processes never read a partly written index.
+ */
+static void jar_cache_write(const char *cache_path, unsigned long long size, long long mtime,
+                            const struct JarIndex *index) {
+  unsigned int i;
+  char *tmp_path;
+  FILE *fd;
+  int res;
+
+  tmp_path = malloc(strlen(cache_path) + 16);
+  if (!tmp_path)
+    return;
+  sprintf(tmp_path, "%s.%u", cache_path, (unsigned int)getpid());
+
+  /* Best effort, the jar may sit in a read-only directory */
+  fd = fopen(tmp_path, "w");
+  if (fd == NULL) {
+    free(tmp_path);
+    return;
+  }
+  fprintf(fd, "%s\n%llu %lld\n", JAR_INDEX_MAGIC, size, mtime);
+  for (i = 0; i < index->count; i++) {
+    const struct JarEntry *entry = &index->entries[i];
+    fprintf(fd, "%u %u %u %u %08x %s\n", entry->header_offset, entry->method,
+            entry->compressed_size, entry->size, entry->crc, entry->name);
+  }
+  res = ferror(fd);
+  if (fclose(fd))
+    res = -1;
+#ifdef WINDOWS
+  if (!res && !MoveFileExA(tmp_path, cache_path, MOVEFILE_REPLACE_EXISTING))
+    res = -1;
+#else
+  if (!res)
+    res = rename(tmp_path, cache_path);
+#endif
+  if (res)
+    remove(tmp_path);
+  free(tmp_path);
+}
+
+/* Index of the .bin entries of the jar, from the cache if it is up to date */
+int jar_index_load(const char *jar_path, const uint8_t *jar, size_t jar_size, struct JarIndex *index) {
+  unsigned long long size = 0;
+  long long mtime = 0;
+  char *cache_path;
+  int res;
+
+  memset(index, 0, sizeof(*index));
+  cache_path = malloc(strlen(jar_path) + 5);
+  if (!cache_path)
+    return -1;
+  sprintf(cache_path, "%s.idx", jar_path);
+
+  res = jar_stat(jar_path, &size, &mtime);
+  if (!res && !jar_cache_read(cache_path, size, mtime, index)) {
+    free(cache_path);
+    return 0;
+  }
+  jar_index_free(index);
+
+  if (jar_scan(jar, jar_size, index)) {
+    jar_index_free(index);
+    free(cache_path);
+    return -1;
+  }
+  if (!res)
+    jar_cache_write(cache_path, size, mtime, index);
+  free(cache_path);
+
+  return 0;
+}
+
+void jar_index_free(struct JarIndex *index) {
+  free(index->entries);
+  memset(index, 0, sizeof(*index));
+}
+
+void jar_files_free(struct JarFiles *files) {
+  unsigned int i;
+
+  if (files->data) {
+    for (i = 0; i < files->index.count; i++)
+      free(files->data[i]);
+  }
+  free(files->data);
+  jar_index_free(&files->index);
+  files->data = NULL;
+}
+
+/* Entry with the given file name, in any directory of the jar */
+const struct JarEntry *jar_find(const struct JarIndex *index, const char *name) {
+  const char *base;
+  unsigned int i;
+
+  for (i = 0; i < index->count; i++) {
+    base = strrchr(index->entries[i].name, '/');
+    base = base ? base + 1 : index->entries[i].name;
+    if (!strcmp(base, name) || !strcmp(index->entries[i].name, name))
+      return &index->entries[i];
+  }
+  return NULL;
+}
+
+/* Inflates an entry into out, which holds entry->size bytes */
+int jar_extract(const uint8_t *jar, size_t jar_size, const struct JarEntry *entry, uint8_t *out) {
+  const uint8_t *local = jar + entry->header_offset;
+  size_t data_offset;
+  z_stream stream;
+  int res;
+
+  if ((uint64_t)entry->header_offset + ZIP_LOCAL_SIZE > jar_size || jar_le32(local) != ZIP_LOCAL_SIG)
+    return -1;
+  data_offset = (size_t)entry->header_offset + ZIP_LOCAL_SIZE + jar_le16(local + 26) + jar_le16(local + 28);
+  if ((uint64_t)data_offset + entry->compressed_size > jar_size)
+    return -1;
+
+  switch (entry->method) {
+  case ZIP_STORED:
+    if (entry->compressed_size != entry->size)
+      return -1;
+    memcpy(out, jar + data_offset, entry->size);
+    break;
+  case ZIP_DEFLATED:
+    memset(&stream, 0, sizeof(stream));
+    /* Raw deflate data, no zlib header */
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+      return -1;
+    stream.next_in = (Bytef *)(jar + data_offset);
+    stream.avail_in = entry->compressed_size;
+    stream.next_out = out;
+    stream.avail_out = entry->size;
+    res = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    if (res != Z_STREAM_END || stream.total_out != entry->size)
+      return -1;
+    break;
+  default:
+    return -1;
+  }
+
+  if (crc32(0, out, entry->size) != entry->crc)
+    return -1;
+  return 0;
+}
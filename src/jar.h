@@ -0,0 +1,56 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef _JAR_H
+#define _JAR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JAR_NAME_MAX 128
+
+/* A .bin entry of the jar central directory */
+struct JarEntry {
+  char name[JAR_NAME_MAX];
+  uint32_t header_offset;
+  uint32_t compressed_size;
+  uint32_t size;
+  uint32_t crc;
+  uint16_t method;
+};
+
+struct JarIndex {
+  struct JarEntry *entries;
+  unsigned int count;
+};
+
+/* The index of a jar with its entries inflated, data[i] is NULL if entry i failed */
+struct JarFiles {
+  struct JarIndex index;
+  uint8_t **data;
+};
+
+int jar_index_load(const char *jar_path, const uint8_t *jar, size_t jar_size, struct JarIndex *index);
+void jar_index_free(struct JarIndex *index);
+void jar_files_free(struct JarFiles *files);
+const struct JarEntry *jar_find(const struct JarIndex *index, const char *name);
+int jar_extract(const uint8_t *jar, size_t jar_size, const struct JarEntry *entry, uint8_t *out);
+
+#endif //_JAR_H
@@ -25,7 +25,16 @@
   #include <getopt.h>
 #endif
 
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+
 #include "stlink.h"
+#include "parallel.h"
+#include "timing.h"
+#include "trace.h"
+#include "emulator.h"
+#include "record.h"
 
 #ifndef min
   #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -33,17 +42,16 @@
 
 #define max_per_line(x) (++x % 2 == 0 ? '\n' : '\0')
 
-#define STLINK_VID        0x0483
-#define STLINK_PID        0x3748
-#define STLINK_PIDV21     0x374b
-#define STLINK_PIDV21_MSD 0x3752
-#define STLINK_PIDV3      0x374f
-#define STLINK_PIDV3_BL   0x374d
-
 #define OPENMOKO_VID      0x1d50
 #define BMP_APPL_PID      0x6018
 #define BMP_DFU_IF        4
 
+#define GANG_MAX          32
+/* Upper bound of --threads, more would only contend for the CPUs */
+#define THREADS_MAX       64
+/* Fixed wait for a switched dongle whose port path is unknown */
+#define SWITCH_SLEEP_US   3000000
+
 enum OptionsVal {
   optHELP = 0,
   optPROBE,
@@ -52,6 +60,26 @@ enum OptionsVal {
   optST_TYPE,
   optVERSION,
   optFIX,
+  optSPARSE,
+  optFLASH_SIZE,
+  optRESERVED_FLASH,
+  optBLOCK_ADDRESSING,
+  optDRY_RUN,
+  optVERIFY,
+  optSTEPWISE_CONFIG,
+  optGANG,
+  optENUM_TIMEOUT,
+  optTHREADS,
+  optJAR,
+  optJAR_ENTRY,
+  optTIMINGS,
+  optTRACE,
+  optEMULATE,
+  optEMULATE_FLASH,
+  optEMULATE_LATENCY,
+  optRECORD,
+  optREPLAY,
+  optREPLAY_SCALE,
   optUSB_CUR,
   optMSD_NAME,
   optMBED_NAME,
@@ -82,6 +110,27 @@ static struct option long_options[] = {
 
   {"fix",            0, 0,  optFIX},
   {"f",              0, 0,  optFIX},
+
+  {"sparse",         0, 0,  optSPARSE},
+  {"block_addressing", 0, 0, optBLOCK_ADDRESSING},
+  {"dry_run",        1, 0,  optDRY_RUN},
+  {"flash_size",     1, 0,  optFLASH_SIZE},
+  {"reserved_flash", 1, 0,  optRESERVED_FLASH},
+  {"verify",         0, 0,  optVERIFY},
+  {"stepwise_config", 0, 0, optSTEPWISE_CONFIG},
+  {"gang",           0, 0,  optGANG},
+  {"enum_timeout",   1, 0,  optENUM_TIMEOUT},
+  {"threads",        1, 0,  optTHREADS},
+  {"jar",            1, 0,  optJAR},
+  {"jar_entry",      1, 0,  optJAR_ENTRY},
+  {"timings",        2, 0,  optTIMINGS},
+  {"trace",          1, 0,  optTRACE},
+  {"emulate",        1, 0,  optEMULATE},
+  {"emulate_flash",  1, 0,  optEMULATE_FLASH},
+  {"emulate_latency", 1, 0, optEMULATE_LATENCY},
+  {"record",         1, 0,  optRECORD},
+  {"replay",         1, 0,  optREPLAY},
+  {"replay_scale",   1, 0,  optREPLAY_SCALE},
    
   {"usb_cur",        1, 0,  optUSB_CUR},
   {"rm_usb_cur",     0, 0,  optUSB_CUR},
@@ -109,6 +158,7 @@ static struct option long_options[] = {
 
 void print_help(char *argv[]) {
   printf("Usage: %s [options] [firmware.bin]\n", argv[0]);
+  printf("Pass - as firmware.bin to read the firmware from stdin.\n");
   printf("Options:\n");
   printf("  -h, --help\t\tShow help\n");
   printf("  -p, --probe\t\tProbe the ST-Link adapter\n");
@@ -120,7 +170,27 @@ void print_help(char *argv[]) {
       printf("\t\t\t  %c for \"%s\"\n", (char)i, st_types[i]);
   }
   printf("  -v, --ver S.J.X\tChange reported STLink sersion.\n\t\t\t  S is STLink version, J is JTAG version,\n\t\t\t  X is SWIM or MSD version.\n");
-  printf("  -f, --fix\t\tFlash Anti-Clone Tag and Firmware Exists/EOF Tag\n\n");
+  printf("  -f, --fix\t\tFlash Anti-Clone Tag and Firmware Exists/EOF Tag\n");
+  printf("  --stepwise_config	Write the config area one field at a time instead\n\t\t\tof as a single page\n");
+  printf("  --jar FILE\t\tFlash the firmware for the dongle straight from\n\t\t\tSTLinkUpgrade.jar FILE\n");
+  printf("  --jar_entry NAME\tUse the firmware NAME from the jar\n");
+  printf("  --threads N\t\tDecrypt with N threads (default one per CPU)\n");
+  printf("  --sparse\t\tSkip writing blank (all 0xFF) chunks and trailing\n\t\t\tblank pages\n");
+  printf("  --block_addressing\tSet the address once per region on V2 bootloaders\n\t\t\tand send increasing block numbers after it\n");
+  printf("  --verify\t\tRead back the firmware after flashing and rewrite\n\t\t\tchunks that differ\n");
+  printf("  --gang\t\tFlash every connected ST-Link bootloader at once\n\t\t\tand print a result table\n");
+  printf("  --enum_timeout MS\tWait at most MS milliseconds for a dongle to come\n\t\t\tback as bootloader (default %d)\n", ENUM_TIMEOUT_MS);
+  printf("  --timings[=json]\tPrint count, total, min, max, p50 and p99 time of\n\t\t\teach phase of the session\n");
+  printf("  --trace FILE\t\tSave the USB transfers as a pcap file for Wireshark\n");
+  printf("  --dry_run TYPE\tPrint the erase plan and estimated flash time for\n\t\t\tbootloader TYPE (V2, V21 or V3) without a device\n");
+  printf("  --flash_size KB\tFlash size of the dry run (default 64 for V2, 128\n\t\t\tfor V21 and 255 for V3)\n");
+  printf("  --reserved_flash KB\tFlash reserved at the end in the dry run (default 0)\n");
+  printf("  --emulate TYPE\tRun against an emulated bootloader TYPE (V2, V21\n\t\t\tor V3) instead of a dongle\n");
+  printf("  --emulate_flash FILE\tLoad the emulated flash from FILE if it exists and\n\t\t\tsave it there after the run\n");
+  printf("  --emulate_latency US\tDelay every transfer to the emulator by US\n\t\t\tmicroseconds (default 0)\n");
+  printf("  --record FILE\t\tSave every transfer of the session with its timing\n\t\t\tand response to FILE\n");
+  printf("  --replay FILE\t\tRun against the responses recorded in FILE instead\n\t\t\tof a dongle and compare the timings\n");
+  printf("  --replay_scale X\tMultiply the recorded bus times by X (default 1)\n\n");
   printf("Options for Modifying Device Config (Only for STLink v2 and up):\n");
   printf("  --usb_cur CURRENT\tSet the MaxPower reported in USB Descriptor\n\t\t\tto CURRENT(mA)\n");
   printf("  --msd_name VOLUME\tSet the volsume name of the MSD drive to VOLUME.\n");
@@ -131,18 +201,341 @@ void print_help(char *argv[]) {
   printf("  --startup OPT\t\tSet Startup Preferences to OPT.\n\t\t\t  0: High Power\n\t\t\t  1: Balanced\n\t\t\t  2: Low Power\n\t\t\t  3: Default\n");
   printf("  To remove a configuration you can use the \"\" argument with the option\n  (Ex. --usb_cur \"\") or prefix the option with rm_ (Ex. --rm_usb_cur).\n\n");
   printf("Application in Flash is started when called without argument, after firmware\nload or configuration change.\n\n");
+  printf("The bootloader busy times learned while flashing are kept in ~/.stlink-tool-poll,\nor in the file STLINK_TOOL_POLL_PROFILE names. Set it empty to not use one.\n\n");
+}
+
+/* Waits for switched dongles to come back as bootloaders, see --enum_timeout */
+static void wait_bootloader(struct STLinkInfo *info, const struct USBPortPath *paths,
+                            unsigned int count) {
+  uint64_t latency_us, timing_start = TIMING_BEGIN();
+  int res;
+
+  if (!paths) {
+    /* Nothing to watch for, sleep and let the caller rescan */
+    usleep(SWITCH_SLEEP_US);
+    TIMING_END(tmDFU_SWITCH, timing_start);
+    return;
+  }
+  res = stlink_wait_bootloader(info->stinfo_usb_ctx, paths, count, info->enum_timeout_us, &latency_us);
+  TIMING_END(tmDFU_SWITCH, timing_start);
+  if (res)
+    fprintf(stderr, "Bootloader did not enumerate within %.0f ms\n", latency_us / 1000.0);
+  else
+    printf("Bootloader enumerated after %.0f ms\n", latency_us / 1000.0);
+}
+
+/* Releases the dongle claimed by main(), nothing to do for the emulator */
+static void release_dongle(struct STLinkInfo *info) {
+  if (info->stinfo_dev_handle)
+    libusb_release_interface(info->stinfo_dev_handle, 0);
+}
+
+/* Output of --timings and --trace, the session phase spans libusb_init() to the end */
+static void session_report(uint64_t session_start, bool timings_json, const char *trace_file) {
+  if (timing_enabled) {
+    TIMING_END(tmSESSION, session_start);
+    timing_report(timings_json);
+  }
+  if (trace_file)
+    trace_save(trace_file);
+}
+
+struct GangDevice {
+  struct STLinkInfo info;
+  char location[32];
+  const char *stage;
+  int result;
+  uint64_t time_us;
+};
+
+struct GangJob {
+  struct GangDevice *devices;
+  struct STLinkConfig *config;
+  const char *filename;
+  bool probe;
+  bool decrypt;
+  bool flash_config;
+};
+
+/* Switches every ST-Link in application mode to its bootloader */
+static int gang_switch_apps(libusb_context *usb_ctx, struct USBPortPath *paths) {
+  libusb_device **devs;
+  libusb_device_handle *handle;
+  struct libusb_device_descriptor desc;
+  int i, switched = 0;
+
+  if (libusb_get_device_list(usb_ctx, &devs) < 0)
+    return 0;
+  for (i = 0; devs[i]; i++) {
+    if (libusb_get_device_descriptor(devs[i], &desc) < 0 || desc.idVendor != STLINK_VID)
+      continue;
+    if (desc.idProduct != STLINK_PIDV21 && desc.idProduct != STLINK_PIDV21_MSD &&
+        desc.idProduct != STLINK_PIDV3)
+      continue;
+    if (libusb_open(devs[i], &handle) < 0) {
+      fprintf(stderr, "Can not open STLINK/Application!\n");
+      continue;
+    }
+    if (!libusb_claim_interface(handle, 0)) {
+      if (switched < GANG_MAX && stlink_dfu_mode(handle, 0) == 0x8000 &&
+          !stlink_port_path(devs[i], &paths[switched])) {
+        stlink_dfu_mode(handle, 1);
+        switched++;
+      }
+      libusb_release_interface(handle, 0);
+    }
+    libusb_close(handle);
+  }
+  libusb_free_device_list(devs, 1);
+
+  return switched;
+}
+
+/* Opens every ST-Link bootloader, each one gets a copy of info */
+static unsigned int gang_open(struct STLinkInfo *info, struct GangDevice *devices) {
+  libusb_device **devs;
+  struct libusb_device_descriptor desc;
+  struct GangDevice *dev;
+  uint8_t ports[8];
+  unsigned int count = 0;
+  int i, p, n_ports, len;
+
+  if (libusb_get_device_list(info->stinfo_usb_ctx, &devs) < 0)
+    return 0;
+  for (i = 0; devs[i]; i++) {
+    if (libusb_get_device_descriptor(devs[i], &desc) < 0 || desc.idVendor != STLINK_VID)
+      continue;
+    if (desc.idProduct != STLINK_PID && desc.idProduct != STLINK_PIDV3_BL)
+      continue;
+    if (count == GANG_MAX) {
+      fprintf(stderr, "More than %d ST-Link bootloaders found, ignoring the rest\n", GANG_MAX);
+      break;
+    }
+
+    dev = &devices[count];
+    dev->info = *info;
+    if (libusb_open(devs[i], &dev->info.stinfo_dev_handle) < 0) {
+      fprintf(stderr, "Can not open STLINK/Bootloader!\n");
+      continue;
+    }
+    transport_libusb(&dev->info.transport, info->stinfo_usb_ctx, dev->info.stinfo_dev_handle);
+    dev->info.stinfo_ep_in = 1 | LIBUSB_ENDPOINT_IN;
+    if (desc.idProduct == STLINK_PIDV3_BL) {
+      dev->info.stinfo_ep_out = 1 | LIBUSB_ENDPOINT_OUT;
+      dev->info.stinfo_bl_type = STLINK_BL_V3;
+    } else {
+      dev->info.stinfo_ep_out = 2 | LIBUSB_ENDPOINT_OUT;
+      dev->info.stinfo_bl_type = STLINK_BL_V2;
+    }
+    dev->info.quiet = true;
+    /* The dongles already run in parallel, one thread per CPU each would be N x ncpu */
+    if (!dev->info.threads)
+      dev->info.threads = 1;
+
+    /* Bus-port path, stays the same for a dongle on the same hub port */
+    len = snprintf(dev->location, sizeof(dev->location), "%u", libusb_get_bus_number(devs[i]));
+    n_ports = libusb_get_port_numbers(devs[i], ports, sizeof(ports));
+    for (p = 0; p < n_ports && len < (int)sizeof(dev->location); p++)
+      len += snprintf(dev->location + len, sizeof(dev->location) - len,
+                      "%c%u", p ? '.' : '-', ports[p]);
+    count++;
+  }
+  libusb_free_device_list(devs, 1);
+
+  return count;
+}
+
+/* Worker of gang_flash(), the single dongle sequence of main() */
+static void gang_flash_one(void *ctx, unsigned int index) {
+  struct GangJob *job = ctx;
+  struct GangDevice *dev = &job->devices[index];
+  struct STLinkInfo *info = &dev->info;
+  struct STLinkConfig config = *job->config;
+  uint64_t start = stlink_time_us(), timing_start;
+  int res;
+
+  dev->result = -1;
+  dev->stage = "claim";
+  if (libusb_claim_interface(info->stinfo_dev_handle, 0))
+    goto exit;
+
+  dev->stage = "read info";
+  timing_start = TIMING_BEGIN();
+  if (stlink_read_info(info))
+    goto release;
+  TIMING_END(tmREAD_INFO, timing_start);
+  stlink_poll_load(info);
+
+  dev->stage = "mode";
+  res = stlink_current_mode(info);
+  if (res < 0 || (res & 0xfffc))
+    goto release;
+
+  dev->result = 0;
+  if (!job->probe) {
+    if (job->filename) {
+      dev->stage = "flash";
+      if (stlink_flash(info, job->filename, job->decrypt, false))
+        dev->result = -1;
+    }
+    if (!dev->result && job->flash_config) {
+      dev->stage = "config";
+      timing_start = TIMING_BEGIN();
+      if (stlink_flash_config_area(info, &config))
+        dev->result = -1;
+      TIMING_END(tmCONFIG, timing_start);
+    }
+    timing_start = TIMING_BEGIN();
+    stlink_exit_dfu(info);
+    TIMING_END(tmEXIT_DFU, timing_start);
+  }
+
+release:
+  libusb_release_interface(info->stinfo_dev_handle, 0);
+exit:
+  dev->time_us = stlink_time_us() - start;
+}
+
+/*
+ * Flashes every connected ST-Link bootloader at once. Each dongle gets its
+ * own STLinkInfo and worker thread, all of them share the libusb context.
+ */
+static int gang_flash(struct STLinkInfo *info, struct STLinkConfig *config,
+                      const char *filename, bool probe, bool decrypt, bool fix_config) {
+  struct USBPortPath paths[GANG_MAX];
+  struct GangDevice *devices;
+  struct JarFiles jar_files;
+  struct GangJob job;
+  unsigned int count, failed = 0, i, j;
+  uint64_t start, timing_start;
+
+  timing_start = TIMING_BEGIN();
+  count = gang_switch_apps(info->stinfo_usb_ctx, paths);
+  TIMING_END(tmENUMERATE, timing_start);
+  if (count) {
+    fprintf(stderr, "Trying to switch %u STLINK/Application to bootloader\n", count);
+    wait_bootloader(info, paths, count);
+  }
+
+  /* Every worker copies its firmware out of the same inflated jar */
+  if (info->jar && filename && !probe) {
+    if (stlink_jar_open(filename, &jar_files))
+      return -1;
+    info->jar_files = &jar_files;
+  }
+
+  devices = calloc(GANG_MAX, sizeof(*devices));
+  if (!devices) {
+    fprintf(stderr, "Out of memory\n");
+    if (info->jar_files)
+      jar_files_free(&jar_files);
+    info->jar_files = NULL;
+    return -1;
+  }
+  timing_start = TIMING_BEGIN();
+  count = gang_open(info, devices);
+  TIMING_END(tmENUMERATE, timing_start);
+  if (!count) {
+    fprintf(stderr, "No ST-Link in DFU mode found. Replug ST-Link to flash!\n");
+    free(devices);
+    if (info->jar_files)
+      jar_files_free(&jar_files);
+    info->jar_files = NULL;
+    return -1;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.devices = devices;
+  job.config = config;
+  job.filename = filename;
+  job.probe = probe;
+  job.decrypt = decrypt;
+  job.flash_config = fix_config;
+  for (i = 0; i < 9; i++) {
+    if (config->modify[i] != modCOPY)
+      job.flash_config = true;
+  }
+
+  printf("%s %u ST-Link bootloaders\n\n", probe ? "Probing" : "Flashing", count);
+  start = stlink_time_us();
+  parallel_for(count, count, gang_flash_one, &job);
+
+  printf("\n #  Location        Type  STLink ID                 Result           Time  Poll wait  Addr saved\n");
+  for (i = 0; i < count; i++) {
+    struct STLinkInfo *dev_info = &devices[i].info;
+
+    printf("%2u  %-14s  %-4s  ", i, devices[i].location,
+           dev_info->stinfo_bl_type == STLINK_BL_V3 ? "V3" :
+           dev_info->stinfo_bl_type == STLINK_BL_V21 ? "V2-1" : "V2");
+    for (j = 0; j < 12; j += 4)
+      printf("%02X%02X%02X%02X", dev_info->id[j + 3], dev_info->id[j + 2],
+             dev_info->id[j + 1], dev_info->id[j + 0]);
+    if (devices[i].result) {
+      printf("  FAIL %-10s", devices[i].stage);
+      failed++;
+    } else {
+      printf("  OK             ");
+    }
+    printf("  %5.1f s  %6.1f ms  %10u\n", devices[i].time_us / 1000000.0,
+           dev_info->poll_sleep_us / 1000.0, dev_info->skipped_set_address);
+
+    /* The profile file is shared, save one dongle at a time */
+    stlink_poll_save(dev_info);
+    libusb_close(dev_info->stinfo_dev_handle);
+  }
+  printf("\n%u of %u ST-Links done in %.1f s\n", count - failed, count,
+         (stlink_time_us() - start) / 1000000.0);
+  free(devices);
+  if (info->jar_files)
+    jar_files_free(&jar_files);
+  info->jar_files = NULL;
+
+  return failed ? -1 : 0;
+}
+
+/* Parses the decimal argument of option name, which has to be within [min, max] */
+static int parse_number(const char *name, const char *arg, unsigned long min_value,
+                        unsigned long max_value, unsigned long *value) {
+  char *end = NULL;
+
+  errno = 0;
+  /* strtoul() would take "-1" as ULONG_MAX, only plain digits are accepted */
+  if (isdigit((unsigned char)arg[0]))
+    *value = strtoul(arg, &end, 10);
+  if (!end || *end || errno || *value < min_value || *value > max_value) {
+    fprintf(stderr, "Invalid --%s %s, expected a number from %lu to %lu\n", name, arg, min_value, max_value);
+    return -1;
+  }
+  return 0;
 }
 
-#include <string.h>
 int main(int argc, char *argv[]) {
   struct STLinkInfo info;
   struct STLinkConfig config;
-  int res = EXIT_FAILURE, i, opt;
-  bool probe = false, decrypt = false, save_decrypted = false, flash_config = false, fix_config = false;
+  int res = EXIT_FAILURE, exit_code = EXIT_SUCCESS, i, opt;
+  bool probe = false, gang = false, decrypt = false, save_decrypted = false, flash_config = false, fix_config = false;
   char* boot_ver = "";
+  char* dry_run = NULL;
+  unsigned long flash_size = 0, reserved_flash = 0, value;
+  char* jar = NULL;
+  bool timings_json = false;
+  char* trace_file = NULL;
+  char* emulate = NULL;
+  char* emulate_flash = NULL;
+  struct Emulator emulator;
+  enum BlTypes emulate_type;
+  uint32_t emulate_latency = 0;
+  char* record_file = NULL;
+  char* replay = NULL;
+  double replay_scale = 1.0;
+  struct Recording recording;
+  struct Transport recorded;
+  uint64_t session_start, timing_start;
+  struct USBPortPath port_path;
   char ver_type = 'S';
 
-  memset(&info.config, 0, sizeof(info.config));
+  memset(&info, 0, sizeof(info));
+  info.enum_timeout_us = (uint64_t)ENUM_TIMEOUT_MS * 1000;
   memset(info.config.raw_config, 0xFF, sizeof(info.config.raw_config));
   memset(&config, 0, sizeof(config));
   memset(config.raw_config, 0xFF, sizeof(config.raw_config));
@@ -183,6 +576,73 @@ int main(int argc, char *argv[]) {
       case optFIX:
         fix_config = true;
         break;
+      case optSPARSE:
+        info.sparse = true;
+        break;
+      case optBLOCK_ADDRESSING:
+        info.block_addressing = true;
+        break;
+      case optVERIFY:
+        info.verify = true;
+        break;
+      case optSTEPWISE_CONFIG:
+        info.stepwise_config = true;
+        break;
+      case optGANG:
+        gang = true;
+        break;
+      case optENUM_TIMEOUT:
+        if (parse_number("enum_timeout", optarg, 1, ENUM_TIMEOUT_MAX_MS, &value))
+          return EXIT_FAILURE;
+        info.enum_timeout_us = (uint64_t)value * 1000;
+        break;
+      case optTHREADS:
+        if (parse_number("threads", optarg, 1, THREADS_MAX, &value))
+          return EXIT_FAILURE;
+        info.threads = value;
+        break;
+      case optJAR:
+        jar = optarg;
+        break;
+      case optJAR_ENTRY:
+        info.jar_entry = optarg;
+        break;
+      case optTIMINGS:
+        timing_enabled = true;
+        timings_json = optarg && !strcmp(optarg, "json");
+        break;
+      case optTRACE:
+        trace_file = optarg;
+        break;
+      case optEMULATE:
+        emulate = optarg;
+        break;
+      case optEMULATE_FLASH:
+        emulate_flash = optarg;
+        break;
+      case optEMULATE_LATENCY:
+        emulate_latency = atoi(optarg);
+        break;
+      case optRECORD:
+        record_file = optarg;
+        break;
+      case optREPLAY:
+        replay = optarg;
+        break;
+      case optREPLAY_SCALE:
+        replay_scale = atof(optarg);
+        break;
+      case optDRY_RUN:
+        dry_run = optarg;
+        break;
+      case optFLASH_SIZE:
+        if (parse_number("flash_size", optarg, 1, UINT8_MAX, &flash_size))
+          return EXIT_FAILURE;
+        break;
+      case optRESERVED_FLASH:
+        if (parse_number("reserved_flash", optarg, 0, UINT8_MAX, &reserved_flash))
+          return EXIT_FAILURE;
+        break;
       case optUSB_CUR:
         if (optarg && strlen(optarg) > 0) {
           config.modify[confUSB_CUR] = modADD;
@@ -252,10 +712,138 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  int do_load = (optind < argc);
+  char *firmware = (optind < argc) ? argv[optind] : jar;
+  int do_load = (firmware != NULL);
 
+  if (jar) {
+    if (!strcmp(jar, "-")) {
+      fprintf(stderr, "The jar can not be read from stdin\n");
+      return EXIT_FAILURE;
+    }
+    firmware = jar;
+    info.jar = true;
+    decrypt = true;
+    if (config.modify[confST_TYPE] == modADD)
+      info.jar_type = config.stlink_type;
+  }
+
+  if ((flash_size || reserved_flash) && !dry_run) {
+    fprintf(stderr, "--flash_size and --reserved_flash are only used by --dry_run\n");
+    return EXIT_FAILURE;
+  }
+
+  if (dry_run) {
+    /* Typical flash sizes, a connected dongle reports the real one */
+    if (!strcmp(dry_run, "V2")) {
+      info.stinfo_bl_type = STLINK_BL_V2;
+      info.flash_size = 64;
+    } else if (!strcmp(dry_run, "V21")) {
+      info.stinfo_bl_type = STLINK_BL_V21;
+      info.flash_size = 128;
+    } else if (!strcmp(dry_run, "V3")) {
+      info.stinfo_bl_type = STLINK_BL_V3;
+      info.flash_size = 255;
+    } else {
+      print_help(argv);
+      return EXIT_FAILURE;
+    }
+    if (flash_size)
+      info.flash_size = flash_size;
+    info.reserved_flash = reserved_flash;
+    /* The bootloader takes the first 16 KB and the firmware exists flag the last one */
+    if (info.flash_size < 1 + 16 + info.reserved_flash) {
+      fprintf(stderr, "No application flash left with %u KB of flash and %u KB reserved\n",
+              info.flash_size, info.reserved_flash);
+      return EXIT_FAILURE;
+    }
+    if (!do_load) {
+      fprintf(stderr, "No firmware file given\n");
+      return EXIT_FAILURE;
+    }
+    info.bootloader_pid = (info.stinfo_bl_type == STLINK_BL_V3) ? STLINK_PIDV3_BL : STLINK_PID;
+    stlink_poll_load(&info);
+    return stlink_flash_plan(&info, firmware, decrypt) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (replay) {
+    if (emulate || record_file || gang) {
+      fprintf(stderr, "A replay can not be combined with --emulate, --record or --gang\n");
+      return EXIT_FAILURE;
+    }
+    if (replay_scale < 0) {
+      print_help(argv);
+      return EXIT_FAILURE;
+    }
+    if (record_load(&recording, replay))
+      return EXIT_FAILURE;
+  } else if (record_file && gang) {
+    fprintf(stderr, "Gang mode can not be recorded\n");
+    return EXIT_FAILURE;
+  }
+
+  if (emulate) {
+    if (!strcmp(emulate, "V2")) {
+      emulate_type = STLINK_BL_V2;
+    } else if (!strcmp(emulate, "V21")) {
+      emulate_type = STLINK_BL_V21;
+    } else if (!strcmp(emulate, "V3")) {
+      emulate_type = STLINK_BL_V3;
+    } else {
+      print_help(argv);
+      return EXIT_FAILURE;
+    }
+    if (gang) {
+      fprintf(stderr, "Gang mode can not be used with an emulated bootloader\n");
+      return EXIT_FAILURE;
+    }
+    if (emulator_init(&emulator, emulate_type, 0, 0))
+      return EXIT_FAILURE;
+    if (emulate_flash && emulator_load(&emulator, emulate_flash) < 0) {
+      emulator_free(&emulator);
+      return EXIT_FAILURE;
+    }
+    transport_loopback(&info.transport, &emulator, emulate_latency, 0);
+  }
+
+  if (trace_file && trace_start())
+    return EXIT_FAILURE;
+  session_start = TIMING_BEGIN();
   res = libusb_init(&info.stinfo_usb_ctx);
+  if (gang) {
+    if (do_load && !strcmp(firmware, "-")) {
+      fprintf(stderr, "Gang mode can not read the firmware from stdin\n");
+      libusb_exit(info.stinfo_usb_ctx);
+      return EXIT_FAILURE;
+    }
+    res = gang_flash(&info, &config, firmware, probe, decrypt, fix_config);
+    libusb_exit(info.stinfo_usb_ctx);
+    session_report(session_start, timings_json, trace_file);
+    return res ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  if (emulate) {
+    /* Endpoints and bootloader type of a dongle with the PID of the emulator */
+    info.stinfo_dev_handle = NULL;
+    info.stinfo_ep_in  = 1 | LIBUSB_ENDPOINT_IN;
+    if (emulator.pid == STLINK_PIDV3_BL) {
+      info.stinfo_ep_out = 1 | LIBUSB_ENDPOINT_OUT;
+      info.stinfo_bl_type = STLINK_BL_V3;
+    } else {
+      info.stinfo_ep_out = 2 | LIBUSB_ENDPOINT_OUT;
+      info.stinfo_bl_type = STLINK_BL_V2;
+    }
+    goto emulated;
+  }
+  if (replay) {
+    /* Endpoints and bootloader type of the recorded dongle */
+    info.stinfo_dev_handle = NULL;
+    info.stinfo_ep_in = recording.ep_in;
+    info.stinfo_ep_out = recording.ep_out;
+    info.stinfo_bl_type = recording.bl_type;
+    transport_replay(&info.transport, &recording, replay_scale);
+    goto emulated;
+  }
 rescan:
+  timing_start = TIMING_BEGIN();
   info.stinfo_dev_handle = NULL;
   libusb_device **devs;
   int n_devs = libusb_get_device_list(info.stinfo_usb_ctx, &devs);
@@ -274,7 +862,7 @@ rescan:
           continue;
       }
       libusb_claim_interface(info.stinfo_dev_handle, BMP_DFU_IF);
-      res = libusb_control_transfer(info.stinfo_dev_handle,
+      res = trace_control_transfer(info.stinfo_dev_handle,
                                     /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
                                     /* bRequest      */ 0, /*DFU_DETACH,*/
                                     /* wValue        */ 1000,
@@ -287,8 +875,9 @@ rescan:
         fprintf(stderr, "BMP Switch failed\n");
         continue;
       }
+      res = stlink_port_path(dev, &port_path);
       libusb_free_device_list(devs, 1);
-      usleep(2000000);
+      wait_bootloader(&info, res ? NULL : &port_path, 1);
       goto rescan;
       break;
     }
@@ -337,9 +926,10 @@ rescan:
       }
       stlink_dfu_mode(info.stinfo_dev_handle, 1);
       libusb_release_interface(info.stinfo_dev_handle, 0);
+      res = stlink_port_path(dev, &port_path);
       libusb_free_device_list(devs, 1);
       fprintf(stderr, "Trying to switch STLINK/Application to bootloader\n");
-      usleep(3000000);
+      wait_bootloader(&info, res ? NULL : &port_path, 1);
       goto rescan;
       break;
     }
@@ -347,6 +937,7 @@ rescan:
       break;
   }
   libusb_free_device_list(devs, 1);
+  TIMING_END(tmENUMERATE, timing_start);
   if (!info.stinfo_dev_handle) {
     fprintf(stderr, "No ST-Link in DFU mode found. Replug ST-Link to flash!\n");
     return EXIT_FAILURE;
@@ -357,11 +948,26 @@ rescan:
             "may communicate with an ST-Link dongle.\n");
     return EXIT_FAILURE;
   }
+  transport_libusb(&info.transport, info.stinfo_usb_ctx, info.stinfo_dev_handle);
 
+emulated:
+  if (record_file) {
+    record_init(&recording, &info);
+    recorded = info.transport;
+    transport_record(&info.transport, &recorded, &recording);
+  }
+  timing_start = TIMING_BEGIN();
   if (stlink_read_info(&info)) {
-    libusb_release_interface(info.stinfo_dev_handle, 0);
-    return EXIT_FAILURE;
+    exit_code = EXIT_FAILURE;
+    goto release;
   }
+  TIMING_END(tmREAD_INFO, timing_start);
+  stlink_poll_load(&info);
+  /* A replay starts from the busy times the recorded session had learned */
+  if (record_file)
+    recording.poll_profile = info.poll_profile;
+  if (replay)
+    info.poll_profile = recording.poll_profile;
 
   switch (info.stinfo_bl_type) {
   case STLINK_BL_V2:
@@ -430,15 +1036,14 @@ rescan:
 
   res = stlink_current_mode(&info);
   if (res < 0) {
-    libusb_release_interface(info.stinfo_dev_handle, 0);
-    return EXIT_FAILURE;
+    exit_code = EXIT_FAILURE;
+    goto release;
   }
   printf("Current Mode: %d\n\n", res);
 
   if (res & 0xfffc) {
     printf("ST-Link dongle is not in the correct mode. Please unplug and plug the dongle again.\n");
-    libusb_release_interface(info.stinfo_dev_handle, 0);
-    return EXIT_SUCCESS;
+    goto release;
   }
 
   if (!probe) {
@@ -450,17 +1055,46 @@ rescan:
     }
 
     if (do_load)
-      if (stlink_flash(&info, argv[optind], decrypt, save_decrypted))
+      if (stlink_flash(&info, firmware, decrypt, save_decrypted))
         flash_config = fix_config = false;
 
     if (flash_config || fix_config) {
+      timing_start = TIMING_BEGIN();
       stlink_flash_config_area(&info, &config);
+      TIMING_END(tmCONFIG, timing_start);
     }
+    /* Emulated and replayed busy times would spoil the profile of real dongles */
+    if (!emulate && !replay)
+      stlink_poll_save(&info);
+    timing_start = TIMING_BEGIN();
     stlink_exit_dfu(&info);
+    TIMING_END(tmEXIT_DFU, timing_start);
+  }
+
+  /* Failed sessions are saved too, they are the ones worth replaying */
+release:
+  release_dongle(&info);
+  if (emulate) {
+    emulator_report(&emulator);
+    if (emulate_flash)
+      emulator_save(&emulator, emulate_flash);
+    emulator_free(&emulator);
+  }
+  if (record_file) {
+    if (record_save(&recording, record_file))
+      exit_code = EXIT_FAILURE;
+    record_free(&recording);
+  }
+  if (replay) {
+    record_report(&recording, info.transport.transfers, replay_scale);
+    /* A diverged replay does not compare the builds, fail it for scripts */
+    if (recording.diverged)
+      exit_code = EXIT_FAILURE;
+    record_free(&recording);
   }
-  libusb_release_interface(info.stinfo_dev_handle, 0);
 exit_libusb:
   libusb_exit(info.stinfo_usb_ctx);
+  session_report(session_start, timings_json, trace_file);
 
-  return EXIT_SUCCESS;
+  return exit_code;
 }
@@ -0,0 +1,94 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef WINDOWS
+  #include <windows.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include "parallel.h"
+
+struct ParallelJob {
+  void (*fn)(void *ctx, unsigned int index);
+  void *ctx;
+  unsigned int count;
+  unsigned int next;
+};
+
+static void *parallel_worker(void *arg) {
+  struct ParallelJob *job = arg;
+  unsigned int index;
+
+  while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+    job->fn(job->ctx, index);
+  }
+  return NULL;
+}
+
+unsigned int parallel_cpu_count(void) {
+#ifdef WINDOWS
+  SYSTEM_INFO system_info;
+
+  GetSystemInfo(&system_info);
+  return system_info.dwNumberOfProcessors;
+#else
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return cpus > 0 ? cpus : 1;
+#endif
+}
+
+int parallel_for(unsigned int count, unsigned int threads,
+                 void (*fn)(void *ctx, unsigned int index), void *ctx) {
+  struct ParallelJob job = {fn, ctx, count, 0};
+  pthread_t *workers = NULL;
+  unsigned int i, started = 0;
+
+  if (threads == 0)
+    threads = parallel_cpu_count();
+  if (threads > count)
+    threads = count;
+
+  if (threads > 1) {
+    workers = malloc(sizeof(pthread_t) * (threads - 1));
+    if (workers) {
+      for (i = 0; i < threads - 1; i++) {
+        if (pthread_create(&workers[started], NULL, parallel_worker, &job))
+          break;
+        started++;
+      }
+    }
+  }
+
+  /* The calling thread takes its share, and everything if no thread could start */
+  parallel_worker(&job);
+
+  if (workers) {
+    for (i = 0; i < started; i++)
+      pthread_join(workers[i], NULL);
+    free(workers);
+  }
+
+  return 0;
+}
@@ -0,0 +1,335 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * USB session recording for --record and --replay. The recording keeps
+ * every bulk transfer stlink.c issues with its status, the IN data and
+ * the time the bus spent on it. A replay matches the transfers the tool
+ * sends against it, so two builds can be run on identical device
+ * behaviour and compared by wall clock and round-trips.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "record.h"
+
+#define RECORD_MAGIC "STLKREC1"
+
+struct RecordHeader {
+  char magic[8];
+  uint8_t bl_type;
+  uint8_t ep_in;
+  uint8_t ep_out;
+  uint8_t reserved;
+  uint32_t count;
+  uint32_t payload_len;
+  uint32_t reserved2;
+  uint64_t wall_us;
+  uint64_t bus_us;
+  struct DFUPollProfile poll_profile;
+};
+
+void record_init(struct Recording *rec, const struct STLinkInfo *info) {
+  memset(rec, 0, sizeof(*rec));
+  rec->bl_type = info->stinfo_bl_type;
+  rec->ep_in = info->stinfo_ep_in;
+  rec->ep_out = info->stinfo_ep_out;
+  rec->start_us = stlink_time_us();
+}
+
+void record_free(struct Recording *rec) {
+  free(rec->entries);
+  free(rec->payload);
+  rec->entries = NULL;
+  rec->payload = NULL;
+}
+
+int record_load(struct Recording *rec, const char *filename) {
+  struct RecordHeader header;
+  uint32_t i;
+  FILE *file;
+
+  memset(rec, 0, sizeof(*rec));
+  file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    return -1;
+  }
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic))) {
+    fprintf(stderr, "%s is not a USB session recording\n", filename);
+    fclose(file);
+    return -1;
+  }
+
+  rec->bl_type = header.bl_type;
+  rec->ep_in = header.ep_in;
+  rec->ep_out = header.ep_out;
+  rec->poll_profile = header.poll_profile;
+  rec->wall_us = header.wall_us;
+  rec->bus_us = header.bus_us;
+  rec->count = rec->capacity = header.count;
+  rec->payload_len = rec->payload_capacity = header.payload_len;
+  rec->entries = malloc((size_t)rec->count * sizeof(*rec->entries) + 1);
+  rec->payload = malloc(rec->payload_len + 1);
+  if (!rec->entries || !rec->payload) {
+    fprintf(stderr, "Not enough memory for %s\n", filename);
+    goto fail;
+  }
+  if (fread(rec->entries, sizeof(*rec->entries), rec->count, file) != rec->count ||
+      fread(rec->payload, 1, rec->payload_len, file) != rec->payload_len) {
+    fprintf(stderr, "Unable to read %s\n", filename);
+    goto fail;
+  }
+  for (i = 0; i < rec->count; i++) {
+    if (rec->entries[i].actual < 0 || rec->entries[i].actual > rec->entries[i].length ||
+        ((rec->entries[i].endpoint & LIBUSB_ENDPOINT_IN) &&
+         rec->entries[i].offset + (uint64_t)rec->entries[i].actual > rec->payload_len)) {
+      fprintf(stderr, "%s is corrupted at transfer %u\n", filename, i);
+      goto fail;
+    }
+  }
+  fclose(file);
+
+  return 0;
+
+fail:
+  fclose(file);
+  record_free(rec);
+  return -1;
+}
+
+int record_save(struct Recording *rec, const char *filename) {
+  struct RecordHeader header;
+  FILE *file;
+
+  if (rec->failed) {
+    fprintf(stderr, "Not enough memory to record the session, %s not written\n", filename);
+    return -1;
+  }
+  rec->wall_us = stlink_time_us() - rec->start_us;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+  header.bl_type = rec->bl_type;
+  header.ep_in = rec->ep_in;
+  header.ep_out = rec->ep_out;
+  header.count = rec->count;
+  header.payload_len = rec->payload_len;
+  header.wall_us = rec->wall_us;
+  header.bus_us = rec->bus_us;
+  header.poll_profile = rec->poll_profile;
+
+  file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    return -1;
+  }
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(rec->entries, sizeof(*rec->entries), rec->count, file) != rec->count ||
+      fwrite(rec->payload, 1, rec->payload_len, file) != rec->payload_len) {
+    fprintf(stderr, "Unable to write %s\n", filename);
+    fclose(file);
+    return -1;
+  }
+  printf("Recorded %u transfers in %.1f ms to %s\n", rec->count, rec->wall_us / 1000.0, filename);
+
+  return fclose(file) ? -1 : 0;
+}
+
+/* Reserves the entry of a transfer when it is issued, -1 if out of memory */
+int record_add(struct Recording *rec, unsigned char endpoint, const unsigned char *data, int length) {
+  struct RecordEntry *entry;
+
+  if (rec->failed)
+    return -1;
+  if (rec->count == rec->capacity) {
+    uint32_t capacity = rec->capacity ? rec->capacity * 2 : 1024;
+    entry = realloc(rec->entries, capacity * sizeof(*rec->entries));
+    if (!entry) {
+      rec->failed = true;
+      return -1;
+    }
+    rec->entries = entry;
+    rec->capacity = capacity;
+  }
+
+  entry = &rec->entries[rec->count];
+  memset(entry, 0, sizeof(*entry));
+  entry->endpoint = endpoint;
+  entry->length = length;
+  if (!(endpoint & LIBUSB_ENDPOINT_IN) && length > 0)
+    entry->crc = crc32(0, data, length);
+
+  return rec->count++;
+}
+
+/* Fills in the outcome, transfers are on the bus one at a time */
+void record_done(struct Recording *rec, int index, const unsigned char *data, int actual, int status,
+                 uint64_t start_us, uint64_t end_us) {
+  struct RecordEntry *entry;
+  uint64_t begin = start_us > rec->last_done_us ? start_us : rec->last_done_us;
+
+  if (end_us > rec->last_done_us)
+    rec->last_done_us = end_us;
+  if (index < 0 || rec->failed)
+    return;
+
+  entry = &rec->entries[index];
+  entry->actual = actual > 0 ? actual : 0;
+  entry->status = status;
+  entry->service_us = end_us > begin ? end_us - begin : 0;
+  rec->bus_us += entry->service_us;
+
+  if (!(entry->endpoint & LIBUSB_ENDPOINT_IN) || !entry->actual)
+    return;
+  if (rec->payload_len + entry->actual > rec->payload_capacity) {
+    uint32_t capacity = rec->payload_capacity ? rec->payload_capacity : 0x10000;
+    unsigned char *payload;
+
+    while (rec->payload_len + entry->actual > capacity)
+      capacity *= 2;
+    payload = realloc(rec->payload, capacity);
+    if (!payload) {
+      rec->failed = true;
+      return;
+    }
+    rec->payload = payload;
+    rec->payload_capacity = capacity;
+  }
+  entry->offset = rec->payload_len;
+  memcpy(rec->payload + rec->payload_len, data, entry->actual);
+  rec->payload_len += entry->actual;
+}
+
+int record_status(enum libusb_transfer_status status) {
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return LIBUSB_SUCCESS;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return LIBUSB_ERROR_TIMEOUT;
+  case LIBUSB_TRANSFER_STALL:
+    return LIBUSB_ERROR_PIPE;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return LIBUSB_ERROR_NO_DEVICE;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    return LIBUSB_ERROR_OVERFLOW;
+  case LIBUSB_TRANSFER_CANCELLED:
+    return LIBUSB_ERROR_INTERRUPTED;
+  default:
+    return LIBUSB_ERROR_IO;
+  }
+}
+
+enum libusb_transfer_status record_transfer_status(int status) {
+  switch (status) {
+  case LIBUSB_SUCCESS:
+    return LIBUSB_TRANSFER_COMPLETED;
+  case LIBUSB_ERROR_TIMEOUT:
+    return LIBUSB_TRANSFER_TIMED_OUT;
+  case LIBUSB_ERROR_PIPE:
+    return LIBUSB_TRANSFER_STALL;
+  case LIBUSB_ERROR_NO_DEVICE:
+    return LIBUSB_TRANSFER_NO_DEVICE;
+  case LIBUSB_ERROR_OVERFLOW:
+    return LIBUSB_TRANSFER_OVERFLOW;
+  case LIBUSB_ERROR_INTERRUPTED:
+    return LIBUSB_TRANSFER_CANCELLED;
+  default:
+    return LIBUSB_TRANSFER_ERROR;
+  }
+}
+
+/*
+ * Recorded transfer answering the one the tool issues now, NULL once the
+ * replay has diverged. An OUT transfer must carry the same data. Up to
+ * RECORD_LOOKAHEAD recorded transfers may be skipped to find it, so a build
+ * that leaves out requests still runs and shows fewer round-trips. IN
+ * transfers must be the next one recorded.
+ */
+const struct RecordEntry *record_next(struct Recording *rec, unsigned char endpoint,
+                                      const unsigned char *data, int length) {
+  const struct RecordEntry *entry;
+  uint32_t crc = 0, i, end;
+
+  if (rec->diverged)
+    return NULL;
+  if (rec->next == rec->count) {
+    fprintf(stderr, "Replay diverged after the last of %u recorded transfers\n", rec->count);
+    rec->diverged = true;
+    return NULL;
+  }
+
+  if (endpoint & LIBUSB_ENDPOINT_IN) {
+    entry = &rec->entries[rec->next];
+    if (entry->endpoint == endpoint && entry->length == length) {
+      rec->next++;
+      return entry;
+    }
+  } else {
+    if (length > 0)
+      crc = crc32(0, data, length);
+    end = rec->count - rec->next > RECORD_LOOKAHEAD ? rec->next + RECORD_LOOKAHEAD : rec->count;
+    for (i = rec->next; i < end; i++) {
+      entry = &rec->entries[i];
+      if (entry->endpoint == endpoint && entry->length == length && entry->crc == crc) {
+        rec->skipped += i - rec->next;
+        rec->next = i + 1;
+        return entry;
+      }
+    }
+  }
+
+  entry = &rec->entries[rec->next];
+  if (entry->endpoint == endpoint && entry->length == length)
+    fprintf(stderr, "Replay diverged at transfer %u: the data on endpoint %02X differs from the recording\n",
+            rec->next, endpoint);
+  else
+    fprintf(stderr, "Replay diverged at transfer %u: %d bytes on endpoint %02X, recorded %d bytes on %02X\n",
+            rec->next, length, endpoint, entry->length, entry->endpoint);
+  rec->diverged = true;
+  return NULL;
+}
+
+/* Copies the recorded IN data, returns the bytes transferred */
+int record_fill(const struct Recording *rec, const struct RecordEntry *entry, unsigned char *data,
+                int length) {
+  int actual = entry->actual < length ? entry->actual : length;
+
+  if (entry->endpoint & LIBUSB_ENDPOINT_IN)
+    memcpy(data, rec->payload + entry->offset, actual);
+  return actual;
+}
+
+void record_report(const struct Recording *rec, uint64_t transfers, double scale) {
+  uint64_t wall_us = stlink_time_us() - rec->start_us;
+
+  printf("Replay: %llu round-trips, recorded %u (%+lld), %u skipped%s\n",
+         (unsigned long long)transfers, rec->count, (long long)transfers - rec->count, rec->skipped,
+         rec->diverged ? ", diverged" : "");
+  printf("Replay wall clock: %.1f ms, recorded %.1f ms (%+.1f ms, %+.1f%%)\n",
+         wall_us / 1000.0, rec->wall_us / 1000.0, ((double)wall_us - rec->wall_us) / 1000.0,
+         rec->wall_us ? ((double)wall_us - rec->wall_us) * 100.0 / rec->wall_us : 0.0);
+  printf("Replay bus time: %.1f ms, recorded %.1f ms scaled by %.2f\n",
+         rec->replay_bus_us / 1000.0, rec->bus_us / 1000.0, scale);
+}
@@ -0,0 +1,99 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <libusb.h>
+
+#include "stlink.h"
+
+/* Recorded OUT transfers a replay may skip to find the one the tool sends */
+#define RECORD_LOOKAHEAD 16
+
+/* One bulk transfer, in the order it was issued */
+struct RecordEntry {
+  uint8_t endpoint;
+  uint8_t reserved[3];
+  int32_t length;
+  int32_t actual;
+  /* libusb error code, async transfer statuses are converted */
+  int32_t status;
+  /* crc32 of the OUT data, to match the transfers of a replay */
+  uint32_t crc;
+  /* Time the bus spent on this transfer alone, overlap with the previous one left out */
+  uint32_t service_us;
+  /* IN data in the payload buffer, actual bytes */
+  uint32_t offset;
+};
+
+/*
+ * USB session of --record, saved in host byte order as a header, the
+ * entries and the IN payloads. --replay loads it and feeds the
+ * responses back through transport_replay().
+ */
+struct Recording {
+  enum BlTypes bl_type;
+  uint8_t ep_in;
+  uint8_t ep_out;
+  /* Learned busy times at the start, so the replay polls the same way */
+  struct DFUPollProfile poll_profile;
+  uint64_t wall_us;
+  uint64_t bus_us;
+
+  struct RecordEntry *entries;
+  uint32_t count;
+  uint32_t capacity;
+  unsigned char *payload;
+  uint32_t payload_len;
+  uint32_t payload_capacity;
+
+  /* Recording */
+  uint64_t start_us;
+  uint64_t last_done_us;
+  bool failed;
+  /* Replay */
+  uint32_t next;
+  uint32_t skipped;
+  uint64_t replay_bus_us;
+  bool diverged;
+};
+
+void record_init(struct Recording *rec, const struct STLinkInfo *info);
+void record_free(struct Recording *rec);
+int record_load(struct Recording *rec, const char *filename);
+int record_save(struct Recording *rec, const char *filename);
+
+int record_add(struct Recording *rec, unsigned char endpoint, const unsigned char *data, int length);
+void record_done(struct Recording *rec, int index, const unsigned char *data, int actual, int status,
+                 uint64_t start_us, uint64_t end_us);
+
+int record_status(enum libusb_transfer_status status);
+enum libusb_transfer_status record_transfer_status(int status);
+
+const struct RecordEntry *record_next(struct Recording *rec, unsigned char endpoint,
+                                      const unsigned char *data, int length);
+int record_fill(const struct Recording *rec, const struct RecordEntry *entry, unsigned char *data,
+                int length);
+void record_report(const struct Recording *rec, uint64_t transfers, double scale);
+
+#endif //_RECORD_H
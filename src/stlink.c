@@ -22,37 +22,64 @@
 #include <fcntl.h>
 #include <sys/types.h> 
 #include <sys/stat.h>
+#ifndef WINDOWS
+  #include <sys/mman.h>
+#endif
 
 #ifdef WINDOWS
   #include <Winsock2.h>
+  #include <io.h>
 #else
   #include <arpa/inet.h>
 #endif
 
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
 
 #include "crypto.h"
+#include "jar.h"
 #include "stlink.h"
+#include "timing.h"
+#include "trace.h"
 
 #define USB_TIMEOUT 5000
+/* Bootloaders that ignore DFU_UPLOAD must not hold every config write for USB_TIMEOUT */
+#define CONFIG_READ_TIMEOUT 250
+
+#ifndef min
+  #define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+  #define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+/*
+ * Progress and summary output of one dongle. Gang mode runs dongles on
+ * several threads and sets quiet, their results go in its table instead.
+ */
+static void stlink_print(const struct STLinkInfo *info, const char *format, ...) {
+  va_list args;
+
+  if (info->quiet)
+    return;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+/* Streamed firmware: initial buffer size and how far ahead erases run */
+#define STREAM_BUFFER_SIZE  0x10000
+#define STREAM_ERASE_AHEAD  0x4000
 
-#define DFU_DETACH 0x00
-#define DFU_DNLOAD 0x01
-#define DFU_UPLOAD 0x02
-#define DFU_GETSTATUS 0x03
-#define DFU_CLRSTATUS 0x04
-#define DFU_GETSTATE 0x05
-#define DFU_ABORT 0x06
-#define DFU_EXIT  0x07
-#define ST_DFU_INFO   0xF1
-#define ST_DFU_MAGIC  0xF3
-
-#define GET_COMMAND 0x00
-#define SET_ADDRESS_POINTER_COMMAND 0x21
-#define ERASE_COMMAND 0x41
-#define ERASE_SECTOR_COMMAND 0x42
-#define READ_UNPROTECT_COMMAND 0x92
+/* Rough cost of one DFU request on a full-speed bus, for estimates only */
+#define USB_REQUEST_US 1000
+
+#define POLL_PROFILE_FILE ".stlink-tool-poll"
+#define POLL_MIN_STEP_US  200
+#define POLL_MAX_FACTOR   4
+#define ENUM_POLL_US      20000
 
 char typeA[]  = "STM32 Debugger+Audio";
 char typeB1[] = "STM32 Debug+Mass storage+VCP";
@@ -71,6 +98,64 @@ char* st_types[] = {[0] = "Error", ['A'] = typeA, ['B'] = typeB1, ['E'] = typeE,
 static int stlink_erase(struct STLinkInfo *info,  uint32_t address);
 static int stlink_set_address(struct STLinkInfo *info, uint32_t address);
 static int stlink_dfu_status(struct STLinkInfo *info, struct DFUStatus *status);
+static int stlink_dfu_clrstatus(struct STLinkInfo *info);
+static int stlink_dfu_abort(struct STLinkInfo *info);
+static int stlink_read_flash(struct STLinkInfo *info, uint32_t address, unsigned char *data, size_t len,
+      unsigned int timeout);
+
+/* A 16 byte request and its data stage, queued on the transport without waiting */
+struct DFUTransfer {
+  struct libusb_transfer *transfer[2];
+  uint64_t submit_us;
+  int pending;
+  int completed;
+  int status;
+};
+
+struct DFUDownload {
+  unsigned char request[16];
+  unsigned char data[STLINK_CHUNK_SIZE];
+  size_t data_len;
+  enum DFUOperation op;
+  struct DFUTransfer xfer;
+};
+
+struct DFUUpload {
+  unsigned char request[16];
+  unsigned char data[STLINK_CHUNK_SIZE];
+  size_t data_len;
+  uint32_t offset;
+  struct DFUTransfer xfer;
+};
+
+uint64_t stlink_time_us(void) {
+#ifdef WINDOWS
+  LARGE_INTEGER counter, frequency;
+  uint64_t count, freq;
+
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  count = counter.QuadPart;
+  freq = frequency.QuadPart;
+  /* count * 1000000 overflows after about 21 days of uptime at 10 MHz */
+  return count / freq * 1000000 + count % freq * 1000000 / freq;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Bulk transfer over the transport of the dongle, see transport.h */
+static int stlink_bulk_transfer(struct STLinkInfo *info, unsigned char endpoint,
+      unsigned char *data, int length, int *transferred, unsigned int timeout) {
+  struct Transport *transport = &info->transport;
+
+  if (endpoint & LIBUSB_ENDPOINT_IN)
+    return transport->ops->receive(transport, endpoint, data, length, transferred, timeout);
+  return transport->ops->send(transport, endpoint, data, length, transferred, timeout);
+}
 
 char* stlink_get_dev_config(struct STLinkConfig *config, enum ConfigTypes config_type) {
   switch (config_type) {
@@ -125,7 +210,7 @@ int stlink_flash_anticlone_tag(struct STLinkInfo *info) {
     return res;
   }
 
-  printf("Downloaded Anticlone Tag\n");
+  stlink_print(info, "Downloaded Anticlone Tag\n");
   return 0;
 }
 
@@ -147,12 +232,12 @@ int stlink_flash_stlink_type(struct STLinkInfo *info, char st_type) {
     return res;
   }
 
-  printf("Downloaded STLink Type\n");
+  stlink_print(info, "Downloaded STLink Type\n");
   return 0;
 }
 
-int stlink_flash_dev_config(struct STLinkInfo *info, struct STLinkConfig *config) {
-  int res;
+/* Applies the requested changes to the device configuration read from the ST-Link */
+static void stlink_apply_dev_config(struct STLinkInfo *info, struct STLinkConfig *config) {
   if (config) {
     switch (config->modify[confUSB_CUR]) {
       case modADD:
@@ -227,6 +312,12 @@ int stlink_flash_dev_config(struct STLinkInfo *info, struct STLinkConfig *config
         break;
     }
   }
+}
+
+int stlink_flash_dev_config(struct STLinkInfo *info, struct STLinkConfig *config) {
+  int res;
+
+  stlink_apply_dev_config(info, config);
 
   res = stlink_set_address(info, 0x08003C30);
   if (res) {
@@ -239,7 +330,7 @@ int stlink_flash_dev_config(struct STLinkInfo *info, struct STLinkConfig *config
     return res;
   }
 
-  printf("Downloaded Device Configuration\n");
+  stlink_print(info, "Downloaded Device Configuration\n");
   return 0;
 }
 
@@ -263,17 +354,22 @@ int stlink_flash_software_version(struct STLinkInfo *info, uint16_t version) {
     return res;
   }
 
-  printf("Downloaded Software Version\n");
+  stlink_print(info, "Downloaded Software Version\n");
   return 0;
 }
 
+/* The firmware exists flag takes the last 16 bytes of flash */
+static uint32_t stlink_firmware_exists_flag(struct STLinkInfo *info, uint8_t *data) {
+  memset(data, 0xFF, 16);
+  *(uint32_t*)(data+12) = 0xA50027D3;
+  return 0x08000000 | (((info->hardware_flags & 0x000001 ? 128 : info->flash_size) << 10) - 16);
+}
+
 int stlink_flash_firmware_exists_flag(struct STLinkInfo *info) {
   uint8_t data[16];
   int res;
 
-  uint32_t address = 0x08000000 | (((info->hardware_flags & 0x000001 ? 128 : info->flash_size) << 10) - 16);
-  memset(data, 0xFF, sizeof(data));
-  *(uint32_t*)(data+12) = 0xA50027D3;
+  uint32_t address = stlink_firmware_exists_flag(info, data);
 
   res = stlink_erase(info, address);
   if (res) {
@@ -292,27 +388,15 @@ int stlink_flash_firmware_exists_flag(struct STLinkInfo *info) {
     return res;
   }
 
-  printf("Downloaded Firmware Exists Tag\n");
+  stlink_print(info, "Downloaded Firmware Exists Tag\n");
   return 0;
 }
 
-int stlink_flash_config_area(struct STLinkInfo *info, struct STLinkConfig *config) {
+/* Writes the config page one field at a time, each with its own SET_ADDRESS */
+static int stlink_flash_config_fields(struct STLinkInfo *info, struct STLinkConfig *config,
+      char st_type, uint16_t version) {
   int res;
-  char st_type = info->config.stlink_type;
-  uint16_t version = htons(info->software_version);
-  if (config){
-    if (config->modify[confST_TYPE] == modADD)
-      st_type = config->stlink_type;
-    if (config->modify[confVERSION] == modADD) {
-      version = htons(config->soft_version);
-    }
-  }
 
-  res = stlink_erase(info, 0x08003C00);
-  if (res) {
-    fprintf(stderr, "Erase error at 0x%08x\n", 0x08003C00);
-    return res;
-  }
   res = stlink_flash_anticlone_tag(info);
   if (res) {
     fprintf(stderr, "Error Downloading Anticlone Tag\n");
@@ -333,12 +417,129 @@ int stlink_flash_config_area(struct STLinkInfo *info, struct STLinkConfig *confi
     fprintf(stderr, "Error Downloading Software Version\n");
     return res;
   }
-  res = stlink_flash_firmware_exists_flag(info);
+
+  return 0;
+}
+
+/*
+ * Builds the content of the config page at 0x08003C00. The bytes between
+ * the fields are left at 0xFF, as after the erase.
+ */
+static void stlink_config_page(struct STLinkInfo *info, struct STLinkConfig *config,
+      char st_type, uint16_t version, uint8_t *page) {
+  stlink_apply_dev_config(info, config);
+
+  memset(page, 0xFF, STLINK_PAGE_SIZE);
+  memcpy(page + 0x00, info->anti_clone, 16);
+  page[0x20] = st_type;
+  memcpy(page + 0x30, info->config.raw_config, sizeof(info->config.raw_config));
+  *(uint16_t*)(page + 0x3FE) = version;
+}
+
+/* Whether len bytes of flash at address already hold data, false if they can't be read back */
+static bool stlink_flash_matches(struct STLinkInfo *info, uint32_t address,
+      const uint8_t *data, size_t len) {
+  unsigned char current[STLINK_PAGE_SIZE];
+
+  if (stlink_read_flash(info, address, current, len, CONFIG_READ_TIMEOUT))
+    return false;
+  return !memcmp(current, data, len);
+}
+
+/* Writes the whole config page with a single SET_ADDRESS and DNLOAD */
+static int stlink_flash_config_page(struct STLinkInfo *info, const uint8_t *page) {
+  int res;
+
+  res = stlink_set_address(info, 0x08003C00);
+  if (res) {
+    fprintf(stderr, "Set Address Error at 0x%08x\n", 0x08003C00);
+    return res;
+  }
+  res = stlink_dfu_download(info, page, STLINK_PAGE_SIZE, 2);
   if (res) {
-    fprintf(stderr, "Error Downloading Firmware Exists Tag\n");
+    fprintf(stderr, "Download Error at 0x%08x\n", 0x08003C00);
     return res;
   }
 
+  stlink_print(info, "Downloaded Configuration Area\n");
+  return 0;
+}
+
+int stlink_flash_config_area(struct STLinkInfo *info, struct STLinkConfig *config) {
+  int res;
+  uint8_t page[STLINK_PAGE_SIZE], flag[16], raw_config[sizeof(info->config.raw_config)];
+  uint32_t flag_address;
+  bool page_ok, flag_ok;
+  char st_type = info->config.stlink_type;
+  uint16_t version = htons(info->software_version);
+  if (config){
+    if (config->modify[confST_TYPE] == modADD)
+      st_type = config->stlink_type;
+    if (config->modify[confVERSION] == modADD) {
+      version = htons(config->soft_version);
+    }
+  }
+
+  /*
+   * There is nothing to erase if the device already holds the requested state.
+   * stlink_read_info() has the type, the version and on bootloaders with a
+   * device config the config too. Only the anti-clone tag, a config the
+   * bootloader did not report and the firmware exists flag are read back.
+   */
+  memcpy(raw_config, info->config.raw_config, sizeof(raw_config));
+  stlink_config_page(info, config, st_type, version, page);
+  flag_address = stlink_firmware_exists_flag(info, flag);
+  page_ok = st_type == info->config.stlink_type && version == htons(info->software_version);
+  if (page_ok && info->has_dev_config)
+    page_ok = !memcmp(raw_config, info->config.raw_config, sizeof(raw_config)) &&
+              stlink_flash_matches(info, 0x08003C00, page, 16);
+  else if (page_ok)
+    page_ok = stlink_flash_matches(info, 0x08003C00, page, 0x30 + sizeof(raw_config));
+  flag_ok = stlink_flash_matches(info, flag_address, flag, sizeof(flag));
+  if (page_ok && flag_ok) {
+    stlink_print(info, "Configuration Area already up to date, skipping write\n");
+    return 0;
+  }
+
+  if (page_ok) {
+    stlink_print(info, "Configuration Area already up to date\n");
+  } else {
+    res = stlink_erase(info, 0x08003C00);
+    if (res) {
+      fprintf(stderr, "Erase error at 0x%08x\n", 0x08003C00);
+      return res;
+    }
+    if (info->stepwise_config) {
+      res = stlink_flash_config_fields(info, config, st_type, version);
+    } else {
+      res = stlink_flash_config_page(info, page);
+      if (res < -1) {
+        /* Bootloader rejected the page write, erase again and write the fields one by one */
+        stlink_print(info, "Bootloader rejected the config page write, falling back to field writes\n");
+        res = stlink_dfu_clrstatus(info);
+        if (!res)
+          res = stlink_erase(info, 0x08003C00);
+        if (res) {
+          fprintf(stderr, "Erase error at 0x%08x\n", 0x08003C00);
+          return res;
+        }
+        res = stlink_flash_config_fields(info, config, st_type, version);
+      }
+    }
+    if (res)
+      return res;
+  }
+
+  if (flag_ok) {
+    stlink_print(info, "Firmware Exists Tag already set\n");
+  } else {
+    res = stlink_flash_firmware_exists_flag(info);
+    if (res) {
+      fprintf(stderr, "Error Downloading Firmware Exists Tag\n");
+      return res;
+    }
+  }
+
   return 0;
 }
 
@@ -351,7 +552,7 @@ int stlink_dfu_mode(libusb_device_handle *dev_handle, int trigger) {
   data[0] = 0xF9;
   if (trigger) data[1] = DFU_DNLOAD;
   /* Write */
-  res = libusb_bulk_transfer(dev_handle,
+  res = trace_bulk_transfer(dev_handle,
                               1 | LIBUSB_ENDPOINT_OUT,
                               data,
                               sizeof(data),
@@ -363,7 +564,7 @@ int stlink_dfu_mode(libusb_device_handle *dev_handle, int trigger) {
   }
   if (!trigger) {
     /* Read */
-    libusb_bulk_transfer(dev_handle,
+    trace_bulk_transfer(dev_handle,
                           1 | LIBUSB_ENDPOINT_IN,
                           data,
                           2,
@@ -377,6 +578,95 @@ int stlink_dfu_mode(libusb_device_handle *dev_handle, int trigger) {
   return data[0] << 8 | data[1];
 }
 
+int stlink_port_path(libusb_device *dev, struct USBPortPath *path) {
+  int depth;
+
+  memset(path, 0, sizeof(*path));
+  depth = libusb_get_port_numbers(dev, path->ports, sizeof(path->ports));
+  if (depth < 0)
+    return -1;
+  path->bus = libusb_get_bus_number(dev);
+  path->depth = depth;
+  return 0;
+}
+
+/* Bootloaders seen so far at the awaited port paths */
+struct EnumWait {
+  const struct USBPortPath *paths;
+  unsigned int count;
+  unsigned int arrived;
+  uint64_t found;
+};
+
+static void stlink_enum_check(struct EnumWait *wait, libusb_device *dev) {
+  struct libusb_device_descriptor desc;
+  struct USBPortPath path;
+  unsigned int i;
+
+  if (libusb_get_device_descriptor(dev, &desc) < 0 || desc.idVendor != STLINK_VID)
+    return;
+  if (desc.idProduct != STLINK_PID && desc.idProduct != STLINK_PIDV3_BL)
+    return;
+  if (stlink_port_path(dev, &path))
+    return;
+
+  for (i = 0; i < wait->count; i++) {
+    if (!(wait->found & (1ULL << i)) && !memcmp(&path, &wait->paths[i], sizeof(path))) {
+      wait->found |= 1ULL << i;
+      wait->arrived++;
+    }
+  }
+}
+
+static int LIBUSB_CALL stlink_enum_arrived(libusb_context *usb_ctx, libusb_device *dev,
+      libusb_hotplug_event event, void *user_data) {
+  stlink_enum_check(user_data, dev);
+  return 0;
+}
+
+/*
+ * Waits until a bootloader shows up at each of the given port paths, at
+ * most timeout_us. Uses hotplug events when libusb has them and polls the
+ * device list otherwise. Returns -1 if some bootloader did not show up.
+ */
+int stlink_wait_bootloader(libusb_context *usb_ctx, const struct USBPortPath *paths,
+      unsigned int count, uint64_t timeout_us, uint64_t *latency_us) {
+  struct EnumWait wait = {paths, min(count, 64), 0, 0};
+  libusb_hotplug_callback_handle handle;
+  libusb_device **devs;
+  struct timeval tv;
+  uint64_t start, elapsed;
+  int i;
+
+  start = stlink_time_us();
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+      libusb_hotplug_register_callback(usb_ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                       LIBUSB_HOTPLUG_ENUMERATE, STLINK_VID,
+                                       LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                                       stlink_enum_arrived, &wait, &handle) == LIBUSB_SUCCESS) {
+    while (wait.arrived < wait.count && (elapsed = stlink_time_us() - start) < timeout_us) {
+      tv.tv_sec = 0;
+      tv.tv_usec = min(timeout_us - elapsed, 100000);
+      libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+    }
+    libusb_hotplug_deregister_callback(usb_ctx, handle);
+  } else {
+    while (1) {
+      if (libusb_get_device_list(usb_ctx, &devs) >= 0) {
+        for (i = 0; devs[i]; i++)
+          stlink_enum_check(&wait, devs[i]);
+        libusb_free_device_list(devs, 1);
+      }
+      if (wait.arrived == wait.count || stlink_time_us() - start >= timeout_us)
+        break;
+      usleep(ENUM_POLL_US);
+    }
+  }
+  *latency_us = stlink_time_us() - start;
+
+  return (wait.arrived == wait.count) ? 0 : -1;
+}
+
 int stlink_read_info(struct STLinkInfo *info) {
   unsigned char data[0x40];
   int res, rw_bytes;
@@ -387,7 +677,7 @@ int stlink_read_info(struct STLinkInfo *info) {
   data[1] = 0x80;
 
   /* Write */
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
+  res = stlink_bulk_transfer(info,
            info->stinfo_ep_out,
            data,
            16,
@@ -399,7 +689,7 @@ int stlink_read_info(struct STLinkInfo *info) {
   }
 
   /* Read */
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
+  res = stlink_bulk_transfer(info,
            info->stinfo_ep_in,
            data,
            6,
@@ -419,7 +709,7 @@ int stlink_read_info(struct STLinkInfo *info) {
   data[1] = 0x08;
 
   /* Write */
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
+  res = stlink_bulk_transfer(info,
            info->stinfo_ep_out,
            data,
            16,
@@ -431,7 +721,7 @@ int stlink_read_info(struct STLinkInfo *info) {
   }
 
   /* Read */
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
+  res = stlink_bulk_transfer(info,
            info->stinfo_ep_in,
            data,
            20,
@@ -474,11 +764,13 @@ int stlink_read_info(struct STLinkInfo *info) {
   memcpy(info->firmware_key, data, 4);
   memcpy(info->firmware_key+4, data+8, 12);
   my_encrypt((unsigned char*)"I am key, wawawa", info->firmware_key, 16);
+  crypto_init(&info->firmware_crypto, info->firmware_key);
   /* Anti-Clone Tag generation */
   memcpy(info->anti_clone, data, 4);
   memcpy(info->anti_clone+4, data+8, 12);
   my_encrypt((unsigned char*)"What are you doing", info->anti_clone, 16);
 
+  info->has_dev_config = false;
   if (info->mode > 1) {
     memset(data, 0, sizeof(data));
 
@@ -487,7 +779,7 @@ int stlink_read_info(struct STLinkInfo *info) {
     *(uint16_t*)(data+2) = 0x40;
 
     // Write //
-    res = libusb_bulk_transfer(info->stinfo_dev_handle,
+    res = stlink_bulk_transfer(info,
             info->stinfo_ep_out,
             data,
             16,
@@ -499,7 +791,7 @@ int stlink_read_info(struct STLinkInfo *info) {
     }
 
     // Read //
-    res = libusb_bulk_transfer(info->stinfo_dev_handle,
+    res = stlink_bulk_transfer(info,
             info->stinfo_ep_in,
             data,
             0x40,
@@ -509,9 +801,10 @@ int stlink_read_info(struct STLinkInfo *info) {
       fprintf(stderr, "USB transfer failureR %d\n", res);
       return -1;
     } else if (res == -9) {
-      printf("Bootloader DFU doesn't support 'get device config' command.\n");
+      stlink_print(info, "Bootloader DFU doesn't support 'get device config' command.\n");
     } else {
       memcpy(info->config.raw_config, data, 0x40);
+      info->has_dev_config = true;
       /* printf("Info3: ");
       for (int i = 0; i < 0x40; i++) {
         printf("%02X ", info->config.raw_config[i]);
@@ -554,7 +847,7 @@ int stlink_read_info(struct STLinkInfo *info) {
     data[1] = 0x0A;
 
     // Write //
-    res = libusb_bulk_transfer(info->stinfo_dev_handle,
+    res = stlink_bulk_transfer(info,
             info->stinfo_ep_out,
             data,
             16,
@@ -566,7 +859,7 @@ int stlink_read_info(struct STLinkInfo *info) {
     }
 
     // Read //
-    res = libusb_bulk_transfer(info->stinfo_dev_handle,
+    res = stlink_bulk_transfer(info,
             info->stinfo_ep_in,
             data,
             16,
@@ -576,7 +869,7 @@ int stlink_read_info(struct STLinkInfo *info) {
       fprintf(stderr, "USB transfer failureR %d\n", res);
       return -1;
     } else if (res == -9) {
-      printf("Bootloader DFU doesn't support 'get hardware version' command.\n");
+      stlink_print(info, "Bootloader DFU doesn't support 'get hardware version' command.\n");
     } else {
       info->hardware_version = data[3] << 24 | data[2] << 16 | data[1] << 8 | data[0];
       if (info->hardware_flags & 0x000001)
@@ -598,7 +891,7 @@ int stlink_current_mode(struct STLinkInfo *info) {
   data[0] = 0xF5;
 
   /* Write */
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
+  res = stlink_bulk_transfer(info,
            info->stinfo_ep_out,
            data,
            sizeof(data),
@@ -610,7 +903,7 @@ int stlink_current_mode(struct STLinkInfo *info) {
   }
 
   /* Read */
-  libusb_bulk_transfer(info->stinfo_dev_handle,
+  stlink_bulk_transfer(info,
            info->stinfo_ep_in,
            data,
            2,
@@ -627,57 +920,205 @@ int stlink_current_mode(struct STLinkInfo *info) {
   return data[0] << 8 | data[1];
 }
 
+/* The bootloader only keeps the low 16 bits of the byte sum */
 uint16_t stlink_checksum(const unsigned char *firmware,
        size_t len) {
-  unsigned int i;
-  int ret = 0;
+  return crypto_sum_bytes(firmware, len) & 0xFFFF;
+}
 
-  for (i = 0; i < len; i++) {
-    ret += firmware[i];
-  }
+static void LIBUSB_CALL stlink_dfu_transfer_done(struct libusb_transfer *transfer) {
+  struct DFUTransfer *xfer = transfer->user_data;
 
-  return (uint16_t)ret & 0xFFFF;
+  trace_transfer_done(transfer, xfer->submit_us);
+  if (--xfer->pending == 0)
+    xfer->completed = 1;
 }
 
-int stlink_dfu_download(struct STLinkInfo *info,
+/*
+ * Queues a request on the OUT endpoint followed by its data stage on
+ * data_ep without waiting for either.
+ */
+static int stlink_transfer_submit(struct STLinkInfo *info,
+      struct DFUTransfer *xfer,
+      unsigned char *request,
+      unsigned char data_ep,
       unsigned char *data,
-      const size_t data_len,
-      const uint16_t wBlockNum) {
-  unsigned char download_request[16];
-  struct DFUStatus dfu_status;
-  int rw_bytes, res;
-  memset(download_request, 0, sizeof(download_request));
+      int data_len,
+      unsigned int timeout) {
+  int i, res;
+
+  xfer->completed = 0;
+  xfer->pending = 0;
+  xfer->status = LIBUSB_TRANSFER_COMPLETED;
+  xfer->submit_us = trace_enabled ? stlink_time_us() : 0;
+
+  for (i = 0; i < 2; i++) {
+    xfer->transfer[i] = libusb_alloc_transfer(0);
+    if (!xfer->transfer[i]) {
+      res = LIBUSB_ERROR_NO_MEM;
+      break;
+    }
+    libusb_fill_bulk_transfer(xfer->transfer[i],
+           info->stinfo_dev_handle,
+           i ? data_ep : info->stinfo_ep_out,
+           i ? data : request,
+           i ? data_len : 16,
+           stlink_dfu_transfer_done,
+           xfer,
+           timeout);
+    xfer->pending++;
+    res = info->transport.ops->submit(&info->transport, xfer->transfer[i]);
+    if (res) {
+      xfer->pending--;
+      libusb_free_transfer(xfer->transfer[i]);
+      xfer->transfer[i] = NULL;
+      break;
+    }
+  }
+
+  if (i < 2) {
+    fprintf(stderr, "USB transfer failure\n");
+    if (xfer->pending) {
+      info->transport.ops->cancel(&info->transport, xfer->transfer[0]);
+      while (xfer->pending)
+        info->transport.ops->handle_events(&info->transport, NULL);
+      libusb_free_transfer(xfer->transfer[0]);
+      xfer->transfer[0] = NULL;
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Runs the event loop until both transfers are done */
+static int stlink_transfer_wait(struct STLinkInfo *info, struct DFUTransfer *xfer) {
+  int i, res = 0;
+
+  while (!xfer->completed) {
+    if (info->transport.ops->handle_events(&info->transport, &xfer->completed) < 0) {
+      for (i = 0; i < 2; i++)
+        info->transport.ops->cancel(&info->transport, xfer->transfer[i]);
+      while (xfer->pending)
+        info->transport.ops->handle_events(&info->transport, NULL);
+      break;
+    }
+  }
+
+  for (i = 0; i < 2; i++) {
+    if (xfer->transfer[i]->status != LIBUSB_TRANSFER_COMPLETED ||
+        xfer->transfer[i]->actual_length != xfer->transfer[i]->length) {
+      if (xfer->status == LIBUSB_TRANSFER_COMPLETED)
+        xfer->status = xfer->transfer[i]->status;
+      res = -1;
+    }
+    libusb_free_transfer(xfer->transfer[i]);
+    xfer->transfer[i] = NULL;
+  }
 
-  download_request[0] = ST_DFU_MAGIC;
-  download_request[1] = DFU_DNLOAD;
-  *(uint16_t*)(download_request+2) = wBlockNum; /* wValue */
-  *(uint16_t*)(download_request+4) = stlink_checksum(data, data_len); /* wIndex */
-  *(uint16_t*)(download_request+6) = data_len; /* wLength */
+  return res;
+}
 
-  if (wBlockNum >= 2) {
-    my_encrypt(info->firmware_key, data, data_len);
+/*
+ * Builds the DNLOAD request for the payload in download->data and encrypts
+ * it. wValue is filled in by stlink_dfu_submit(), so a prepared chunk can
+ * still be sent with a different block number.
+ */
+static void stlink_dfu_seal(struct STLinkInfo *info,
+      struct DFUDownload *download,
+      bool encrypt) {
+  uint16_t checksum;
+
+  memset(download->request, 0, sizeof(download->request));
+
+  if (encrypt) {
+    /* The checksum is over the plaintext, summed while it is loaded for the cipher */
+    checksum = crypto_encrypt_sum(&info->firmware_crypto, download->data, download->data_len);
+    download->op = opWRITE;
+  } else {
+    checksum = stlink_checksum(download->data, download->data_len);
+    if (download->data[0] == SET_ADDRESS_POINTER_COMMAND)
+      download->op = opSET_ADDRESS;
+    else
+      download->op = opERASE;
   }
 
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
-             info->stinfo_ep_out,
-             download_request,
-             sizeof(download_request),
-             &rw_bytes,
-             USB_TIMEOUT);
-  if (res || rw_bytes != sizeof(download_request)) {
-    fprintf(stderr, "USB transfer failure\n");
+  download->request[0] = ST_DFU_MAGIC;
+  download->request[1] = DFU_DNLOAD;
+  *(uint16_t*)(download->request+4) = checksum; /* wIndex */
+  *(uint16_t*)(download->request+6) = download->data_len; /* wLength */
+}
+
+/* Copies the payload to the scratch buffer of the download, the caller's data is left untouched */
+static int stlink_dfu_prepare(struct STLinkInfo *info,
+      struct DFUDownload *download,
+      const unsigned char *data,
+      const size_t data_len,
+      bool encrypt) {
+  if (data_len > sizeof(download->data)) {
+    fprintf(stderr, "Download of %u bytes is larger than a chunk\n", (unsigned int)data_len);
     return -1;
   }
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
-           info->stinfo_ep_out,
-           data,
-           data_len,
-           &rw_bytes,
-           USB_TIMEOUT);
-  if (res || rw_bytes != (int)data_len) {
+  memcpy(download->data, data, data_len);
+  download->data_len = data_len;
+  stlink_dfu_seal(info, download, encrypt);
+  return 0;
+}
+
+/* Copies a chunk of the image, the part past the end of the file is padded with 0xFF */
+static void stlink_image_chunk(const struct FirmwareImage *image, uint32_t offset,
+      size_t len, unsigned char *dest) {
+  size_t avail = offset < image->size ? min(len, image->size - offset) : 0;
+
+  memcpy(dest, image->data + offset, avail);
+  memset(dest + avail, 0xFF, len - avail);
+}
+
+/* Same as stlink_dfu_prepare() for a firmware chunk */
+static void stlink_dfu_prepare_chunk(struct STLinkInfo *info,
+      struct DFUDownload *download,
+      const struct FirmwareImage *image,
+      uint32_t offset,
+      size_t len) {
+  stlink_image_chunk(image, offset, len, download->data);
+  download->data_len = len;
+  stlink_dfu_seal(info, download, true);
+}
+
+/* Queues the request and the payload on the OUT endpoint without waiting */
+static int stlink_dfu_submit(struct STLinkInfo *info,
+      struct DFUDownload *download,
+      const uint16_t wBlockNum) {
+  *(uint16_t*)(download->request+2) = wBlockNum; /* wValue */
+
+  return stlink_transfer_submit(info, &download->xfer, download->request,
+                                info->stinfo_ep_out, download->data, download->data_len, USB_TIMEOUT);
+}
+
+static int stlink_dfu_wait(struct STLinkInfo *info, struct DFUDownload *download) {
+  uint64_t timing_start = TIMING_BEGIN();
+
+  if (stlink_transfer_wait(info, &download->xfer)) {
     fprintf(stderr, "USB transfer failure\n");
     return -1;
   }
+  TIMING_END(tmTRANSFER, timing_start);
+  return 0;
+}
+
+/*
+ * Waits for the bootloader to process the last download.
+ *
+ * Rather than sleeping for the whole bwPollTimeout, the first poll is issued
+ * slightly before the busy time learned for this kind of operation, then
+ * with a doubling backoff. Until something has been learned the reported
+ * timeout is used, as before.
+ */
+static int stlink_dfu_finish(struct STLinkInfo *info, enum DFUOperation op) {
+  struct DFUStatus dfu_status;
+  uint64_t start, elapsed, limit, deadline, wait, step, max_step;
+  uint64_t timing_start = TIMING_BEGIN(), timing_sleep;
+  uint32_t learned;
 
   if (stlink_dfu_status(info, &dfu_status)) {
     return -1;
@@ -693,10 +1134,45 @@ int stlink_dfu_download(struct STLinkInfo *info,
     return -3;
   }
 
-  usleep(dfu_status.bwPollTimeout * 1000);
+  start = stlink_time_us();
+  limit = (uint64_t)dfu_status.bwPollTimeout * 1000;
+  info->poll_timeout_us += limit;
+  deadline = limit * POLL_MAX_FACTOR + USB_TIMEOUT * 1000;
+  /* The backoff never sleeps more than a quarter of the reported timeout at once */
+  max_step = max(limit / 4, POLL_MIN_STEP_US);
+
+  learned = info->poll_profile.busy_us[op];
+  if (learned && learned < limit) {
+    wait = learned - learned / 8;
+    step = learned / 16;
+  } else {
+    wait = limit;
+    step = limit / 4;
+  }
+  step = min(max(step, POLL_MIN_STEP_US), max_step);
+
+  while (1) {
+    if (wait) {
+      timing_sleep = TIMING_BEGIN();
+      usleep(wait);
+      TIMING_END(tmPOLL_SLEEP, timing_sleep);
+      info->poll_sleep_us += wait;
+    }
 
-  if (stlink_dfu_status(info, &dfu_status)) {
-    return -1;
+    if (stlink_dfu_status(info, &dfu_status)) {
+      return -1;
+    }
+    elapsed = stlink_time_us() - start;
+
+    if (dfu_status.bState != dfuDNBUSY)
+      break;
+    if (elapsed >= deadline) {
+      fprintf(stderr, "Bootloader still busy after %llu ms\n", (unsigned long long)elapsed / 1000);
+      return -1;
+    }
+
+    wait = min(step, deadline - elapsed);
+    step = min(step * 2, max_step);
   }
 
   if (dfu_status.bState != dfuDNLOAD_IDLE) {
@@ -712,9 +1188,36 @@ int stlink_dfu_download(struct STLinkInfo *info,
     }
   }
 
+  /* Moving average of the observed busy time */
+  if (info->poll_profile.samples[op])
+    info->poll_profile.busy_us[op] = (3 * (uint64_t)learned + elapsed) / 4;
+  else
+    info->poll_profile.busy_us[op] = elapsed;
+  info->poll_profile.samples[op]++;
+
+  TIMING_END((enum TimingPhase)(tmERASE + op), timing_start);
   return 0;
 }
 
+int stlink_dfu_download(struct STLinkInfo *info,
+      const unsigned char *data,
+      const size_t data_len,
+      const uint16_t wBlockNum) {
+  struct DFUDownload download;
+  int res;
+
+  res = stlink_dfu_prepare(info, &download, data, data_len, wBlockNum >= 2);
+  if (!res)
+    res = stlink_dfu_submit(info, &download, wBlockNum);
+  if (res)
+    return res;
+  res = stlink_dfu_wait(info, &download);
+  if (res)
+    return res;
+
+  return stlink_dfu_finish(info, download.op);
+}
+
 int stlink_dfu_status(struct STLinkInfo *info, struct DFUStatus *status) {
   unsigned char data[16];
   int rw_bytes, res;
@@ -725,7 +1228,7 @@ int stlink_dfu_status(struct STLinkInfo *info, struct DFUStatus *status) {
   data[1] = DFU_GETSTATUS;
   data[6] = 0x06; /* wLength */
 
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
+  res = stlink_bulk_transfer(info,
            info->stinfo_ep_out,
            data,
            16,
@@ -735,7 +1238,7 @@ int stlink_dfu_status(struct STLinkInfo *info, struct DFUStatus *status) {
     fprintf(stderr, "USB transfer failure\n");
     return -1;
   }
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
+  res = stlink_bulk_transfer(info,
             info->stinfo_ep_in,
            data,
            6,
@@ -754,6 +1257,49 @@ int stlink_dfu_status(struct STLinkInfo *info, struct DFUStatus *status) {
   return 0;
 }
 
+/* Sends a request without data stage and checks the resulting state */
+static int stlink_dfu_request(struct STLinkInfo *info, unsigned char request) {
+  unsigned char data[16];
+  struct DFUStatus dfu_status;
+  int rw_bytes, res;
+
+  memset(data, 0, sizeof(data));
+
+  data[0] = ST_DFU_MAGIC;
+  data[1] = request;
+
+  res = stlink_bulk_transfer(info,
+           info->stinfo_ep_out,
+           data,
+           16,
+           &rw_bytes,
+           USB_TIMEOUT);
+  if (res || rw_bytes != 16) {
+    fprintf(stderr, "USB transfer failure\n");
+    return -1;
+  }
+
+  if (stlink_dfu_status(info, &dfu_status)) {
+    return -1;
+  }
+
+  if (dfu_status.bState == dfuERROR) {
+    fprintf(stderr, "Unable to clear DFU error state\n");
+    return -2;
+  }
+
+  return 0;
+}
+
+int stlink_dfu_clrstatus(struct STLinkInfo *info) {
+  return stlink_dfu_request(info, DFU_CLRSTATUS);
+}
+
+/* Returns to dfuIDLE, the address pointer is kept */
+int stlink_dfu_abort(struct STLinkInfo *info) {
+  return stlink_dfu_request(info, DFU_ABORT);
+}
+
 int stlink_erase(struct STLinkInfo *info, uint32_t address) {
   unsigned char command[5];
   int res;
@@ -798,152 +1344,1064 @@ int stlink_set_address(struct STLinkInfo *info,  uint32_t address) {
   return res;
 }
 
-int stlink_flash(struct STLinkInfo *info, const char *filename, bool decrypt, bool save) {
-  uint32_t file_size, file_read_size;
-  
-  FILE *fd;
-  int res;
-  struct stat firmware_stat;
-  uint8_t* firmware;
+/* Whether a chunk of the image is entirely 0xFF, padding past the end of the file included */
+static bool stlink_chunk_blank(const struct FirmwareImage *image, uint32_t offset, size_t len) {
+  size_t i;
 
-  fd = fopen(filename, "rb");
-  if (fd == NULL) {
-    fprintf(stderr, "Opening File %s Failed\n", filename);
-    return -1;
+  if (offset >= image->size)
+    return true;
+  len = min(len, image->size - offset);
+  for (i = 0; i < len; i++) {
+    if (image->data[offset + i] != 0xFF)
+      return false;
   }
-  
-  stat(filename, &firmware_stat);
-
-  file_size = firmware_stat.st_size;
-  if (!file_size)
-      return -1;
+  return true;
+}
 
-  printf("Loaded firmware : %s, size : %d bytes\n", filename, (int)file_size);
-  if (file_size > ((uint32_t)(info->flash_size - 1 - 16 - info->reserved_flash) << 10)) {
-    printf("Firmware Size is larger than Flash Size. Continue? [Y/n]: ");
-    while (1) {
-      int c = getchar();
-      if (c != '\n')
-        while ((getchar()) != '\n');
-      if (c > 0)
-        c = tolower(c);
-      if (c == 'n')
-        return -1;
-      if (c == 'y' || c == '\n')
+/*
+ * Makes sure the first `end` bytes of a streamed image have been read, or
+ * the whole stream if it is shorter. Complete AES blocks are decrypted as
+ * they arrive. Returns the number of bytes available.
+ */
+static uint32_t stlink_image_fetch(struct STLinkInfo *info, struct FirmwareImage *image, uint32_t end) {
+  size_t n;
+
+  if (!image->stream || image->eof)
+    return image->size;
+
+  while (image->size < end && !image->eof) {
+    if (image->size + 16 >= image->capacity) {
+      uint32_t capacity = image->capacity ? image->capacity * 2 : STREAM_BUFFER_SIZE;
+      uint8_t *buffer = realloc(image->buffer, capacity);
+      if (!buffer) {
+        fprintf(stderr, "Out of memory reading firmware\n");
+        image->eof = true;
         break;
+      }
+      image->buffer = buffer;
+      image->data = buffer;
+      image->capacity = capacity;
     }
+    /* Keep 16 bytes spare for the padding of the last block */
+    n = fread(image->buffer + image->size, 1, min(image->capacity - 16, end) - image->size, image->stream);
+    if (n == 0) {
+      if (ferror(image->stream))
+        fprintf(stderr, "File Read Failed\n");
+      image->eof = true;
+    }
+    image->size += n;
   }
 
-  int chunk_size = (2 << 10);
-  int padding = (16 - (file_size % 16)) % 16;
-  firmware = malloc(file_size + padding);
-  memset(firmware, 0xFF, file_size + padding);
-  file_read_size = fread(firmware, sizeof(unsigned char), file_size, fd);
-  if (file_read_size <= 0) {
-    fprintf(stderr, "File Read Failed\n");
-    free(firmware);
-    return file_read_size;
+  if (image->decrypt && image->size - image->decrypted >= 16) {
+    uint32_t len = (image->size - image->decrypted) & ~15;
+    crypto_decrypt(image->decrypt, image->buffer + image->decrypted, len);
+    image->decrypted += len;
   }
 
-  if (decrypt) {
-    if (info->decrypt_key)
-      printf("Decrypting Firmware Using Key \"%s\"\n", info->decrypt_key);
-    else {
-      info->decrypt_key = "best performance";
+  if (image->eof) {
+    stlink_print(info, "Loaded firmware : stdin, size : %d bytes\n", (int)image->size);
+    if (image->decrypt && image->decrypted < image->size) {
+      memset(image->buffer + image->size, 0xFF, 16 - (image->size - image->decrypted));
+      crypto_decrypt(image->decrypt, image->buffer + image->decrypted, image->size - image->decrypted);
+      image->decrypted = image->size;
     }
-
-    for(unsigned int i = 0; i < file_size; i += 0xC00) {
-      my_decrypt((unsigned char*)info->decrypt_key, firmware + i, (i + 0xC00) < file_size ? 0xC00 : file_size - i);
+    if (image->save_path) {
+      stlink_print(info, "Saving Decrypted Firmware as %s\n", image->save_path);
+      FILE* fdw = fopen(image->save_path, "wb");
+      if (fdw) {
+        fwrite(image->buffer, sizeof(unsigned char), image->size, fdw);
+        fclose(fdw);
+      }
+    }
+  }
+
+  return image->size;
+}
+
+/* Length of the chunk at offset, 0 past the end of the image or of limit */
+static uint32_t stlink_chunk_len(struct STLinkInfo *info, struct FirmwareImage *image,
+      uint32_t offset, uint32_t limit) {
+  uint32_t end;
+
+  stlink_image_fetch(info, image, offset + STLINK_CHUNK_SIZE);
+  /* The last chunk is padded to 16 bytes when it is prepared */
+  end = min(limit, (image->size + 15) & ~15);
+  return offset < end ? min(STLINK_CHUNK_SIZE, end - offset) : 0;
+}
+
+/* Offset of the next chunk to download, blank chunks are skipped in sparse mode */
+static uint32_t stlink_next_chunk(struct STLinkInfo *info, struct FirmwareImage *image,
+      uint32_t offset, uint32_t limit) {
+  uint32_t len;
+
+  while ((len = stlink_chunk_len(info, image, offset, limit)) && info->sparse &&
+         stlink_chunk_blank(image, offset, len))
+    offset += STLINK_CHUNK_SIZE;
+  return offset;
+}
+
+/*
+ * In sparse mode trailing blank chunks are not written. They are still
+ * erased, the pages may hold data of the previous firmware.
+ */
+static uint32_t stlink_sparse_trim(struct STLinkInfo *info, const struct FirmwareImage *image,
+      uint32_t size) {
+  uint32_t image_size = size;
+
+  if (!info->sparse)
+    return size;
+
+  while (size) {
+    uint32_t last_chunk = ((size - 1) / STLINK_CHUNK_SIZE) * STLINK_CHUNK_SIZE;
+    if (!stlink_chunk_blank(image, last_chunk, size - last_chunk))
+      break;
+    size = last_chunk;
+  }
+  if (size < image_size)
+    stlink_print(info, "Sparse: trimmed %u trailing blank bytes\n", image_size - size);
+
+  return size;
+}
+
+/* Largest firmware the application flash holds */
+static uint32_t stlink_image_limit(const struct STLinkInfo *info) {
+  return (uint32_t)(info->flash_size - 1 - 16 - info->reserved_flash) << 10;
+}
+
+static uint32_t stlink_base_offset(enum BlTypes bl_type) {
+  return (bl_type == STLINK_BL_V3) ? 0x08020000 : 0x08004000;
+}
+
+static int stlink_map_firmware(const char *filename, struct FirmwareImage *image) {
+#ifdef WINDOWS
+  LARGE_INTEGER file_size;
+
+  image->file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (image->file_handle == INVALID_HANDLE_VALUE) {
+    image->file_handle = NULL;
+    return -1;
+  }
+  if (!GetFileSizeEx(image->file_handle, &file_size) || file_size.QuadPart == 0 ||
+      file_size.QuadPart > UINT32_MAX)
+    return -1;
+  image->map_size = file_size.QuadPart;
+  image->map_handle = CreateFileMappingA(image->file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!image->map_handle)
+    return -1;
+  image->map = MapViewOfFile(image->map_handle, FILE_MAP_READ, 0, 0, 0);
+  if (!image->map)
+    return -1;
+#else
+  struct stat firmware_stat;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &firmware_stat) || firmware_stat.st_size == 0 ||
+      (uint64_t)firmware_stat.st_size > UINT32_MAX) {
+    close(fd);
+    return -1;
+  }
+  image->map_size = firmware_stat.st_size;
+  image->map = mmap(NULL, image->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image->map == MAP_FAILED) {
+    image->map = NULL;
+    return -1;
+  }
+#endif
+  image->data = image->map;
+  image->size = image->map_size;
+  return 0;
+}
+
+static void stlink_unmap_firmware(struct FirmwareImage *image) {
+#ifdef WINDOWS
+  if (image->map)
+    UnmapViewOfFile(image->map);
+  if (image->map_handle)
+    CloseHandle(image->map_handle);
+  if (image->file_handle)
+    CloseHandle(image->file_handle);
+  image->map_handle = image->file_handle = NULL;
+#else
+  if (image->map)
+    munmap(image->map, image->map_size);
+#endif
+  image->map = NULL;
+}
+
+void stlink_free_firmware(struct FirmwareImage *image) {
+  stlink_unmap_firmware(image);
+  free(image->buffer);
+  free(image->save_path);
+  memset(image, 0, sizeof(*image));
+}
+
+/*
+ * Firmware files of STLinkUpgrade.jar by bootloader and STLink type, the
+ * first one of a bootloader is used when the type is not known.
+ * The type letters are the ones stored in the config area (see st_types in
+ * main.c), the file names are those of the jar ST ships. ST does not document
+ * the pairing, it follows which file STLinkUpgrade picks for each dongle and
+ * has to be checked again when a new jar changes its contents, --jar_entry
+ * overrides it.
+ */
+static const struct {
+  enum BlTypes bl_type;
+  char stlink_type;
+  const char *name;
+} jar_firmwares[] = {
+  {STLINK_BL_V2,  'M', "f2_1.bin"},
+  {STLINK_BL_V2,  'J', "f2_2.bin"},
+  {STLINK_BL_V2,  'S', "f2_3.bin"},
+  {STLINK_BL_V21, 'B', "f2_4.bin"},
+  {STLINK_BL_V21, 'A', "f2_5.bin"},
+  {STLINK_BL_V21, 'E', "f2_6.bin"},
+  {STLINK_BL_V3,  'F', "f3_1.bin"},
+  {STLINK_BL_V3,  'G', "f3_2.bin"},
+};
+
+static const char *stlink_jar_name(struct STLinkInfo *info) {
+  char stlink_type = info->jar_type ? info->jar_type : info->config.stlink_type;
+  const char *name = NULL;
+  unsigned int i;
+
+  if (info->jar_entry)
+    return info->jar_entry;
+  for (i = 0; i < sizeof(jar_firmwares) / sizeof(jar_firmwares[0]); i++) {
+    if (jar_firmwares[i].bl_type != info->stinfo_bl_type)
+      continue;
+    if (jar_firmwares[i].stlink_type == stlink_type)
+      return jar_firmwares[i].name;
+    if (!name)
+      name = jar_firmwares[i].name;
+  }
+  /* A known type missing from the table may be other hardware, never guess */
+  if (stlink_type && stlink_type != (char)0xFF)
+    return NULL;
+  return name;
+}
+
+/* No dongle has more flash than this, larger jar entries are not firmware */
+#define JAR_FIRMWARE_MAX ((uint32_t)UINT8_MAX << 10)
+
+/*
+ * Inflates every firmware of STLinkUpgrade.jar, the jar itself is only mapped
+ * meanwhile. Gang mode does this once before its workers start, so that they
+ * neither rescan the jar nor rewrite its index cache at the same time.
+ */
+int stlink_jar_open(const char *jar_path, struct JarFiles *files) {
+  struct FirmwareImage jar;
+  const struct JarEntry *entry;
+  unsigned int i;
+
+  memset(files, 0, sizeof(*files));
+  memset(&jar, 0, sizeof(jar));
+  if (stlink_map_firmware(jar_path, &jar)) {
+    fprintf(stderr, "Opening File %s Failed\n", jar_path);
+    stlink_unmap_firmware(&jar);
+    return -1;
+  }
+  if (jar_index_load(jar_path, jar.data, jar.size, &files->index)) {
+    fprintf(stderr, "%s is not a valid jar\n", jar_path);
+    stlink_unmap_firmware(&jar);
+    return -1;
+  }
+  files->data = calloc(files->index.count + 1, sizeof(*files->data));
+  if (!files->data) {
+    fprintf(stderr, "Out of memory\n");
+    stlink_unmap_firmware(&jar);
+    jar_files_free(files);
+    return -1;
+  }
+
+  /* Entries that fail are reported once a dongle asks for them */
+  for (i = 0; i < files->index.count; i++) {
+    entry = &files->index.entries[i];
+    /* The size comes from the jar or its cache, it is checked before allocating */
+    if (entry->size == 0 || entry->size > JAR_FIRMWARE_MAX)
+      continue;
+    files->data[i] = malloc(entry->size);
+    if (files->data[i] && jar_extract(jar.data, jar.size, entry, files->data[i])) {
+      free(files->data[i]);
+      files->data[i] = NULL;
+    }
+  }
+  stlink_unmap_firmware(&jar);
+
+  return 0;
+}
+
+/*
+ * Copies the firmware matching the dongle out of STLinkUpgrade.jar into the
+ * private buffer of image, the jar is opened here unless gang mode shares it.
+ */
+static int stlink_load_jar(struct STLinkInfo *info, const char *jar_path, struct FirmwareImage *image,
+      char *entry_name) {
+  const struct JarFiles *files = info->jar_files;
+  const struct JarEntry *entry;
+  struct JarFiles own_files;
+  const char *name;
+  unsigned int i;
+  int res = -1;
+
+  if (!files) {
+    if (stlink_jar_open(jar_path, &own_files))
+      return -1;
+    files = &own_files;
+  }
+
+  name = stlink_jar_name(info);
+  entry = name ? jar_find(&files->index, name) : NULL;
+  if (!entry) {
+    fprintf(stderr, "No firmware for this ST-Link in %s, pick one with --jar_entry:\n", jar_path);
+    for (i = 0; i < files->index.count; i++)
+      fprintf(stderr, "  %s (%u bytes)\n", files->index.entries[i].name, files->index.entries[i].size);
+    goto exit;
+  }
+  if (entry->size == 0 || entry->size > ((uint32_t)info->flash_size << 10)) {
+    fprintf(stderr, "%s in %s has an invalid size of %u bytes\n", entry->name, jar_path, entry->size);
+    goto exit;
+  }
+  i = entry - files->index.entries;
+  if (!files->data[i]) {
+    fprintf(stderr, "Extracting %s from %s Failed\n", entry->name, jar_path);
+    goto exit;
+  }
+
+  image->buffer = malloc(entry->size + 16);
+  if (!image->buffer) {
+    fprintf(stderr, "Out of memory\n");
+    goto exit;
+  }
+  memcpy(image->buffer, files->data[i], entry->size);
+  memset(image->buffer + entry->size, 0xFF, 16);
+  image->data = image->buffer;
+  image->size = entry->size;
+
+  name = strrchr(entry->name, '/');
+  strcpy(entry_name, name ? name + 1 : entry->name);
+  res = 0;
+
+exit:
+  if (files == &own_files)
+    jar_files_free(&own_files);
+  return res;
+}
+
+/*
+ * Maps a firmware file and optionally decrypts it into a private buffer.
+ * Padding to 16 bytes is left to the chunk that reaches the end of the file.
+ */
+static int stlink_load_firmware(struct STLinkInfo *info, const char *filename,
+      bool decrypt, bool save, bool ask, struct FirmwareImage *image) {
+  char entry_name[JAR_NAME_MAX];
+  uint32_t file_size;
+
+  memset(image, 0, sizeof(*image));
+  if (!strcmp(filename, "-")) {
+    /* Read from stdin as the data comes in, see stlink_image_fetch() */
+#ifdef WINDOWS
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    image->stream = stdin;
+    if (decrypt) {
+      if (info->decrypt_key)
+        stlink_print(info, "Decrypting Firmware Using Key \"%s\"\n", info->decrypt_key);
+      else
+        info->decrypt_key = "best performance";
+      crypto_init(&info->decrypt_crypto, (unsigned char*)info->decrypt_key);
+      image->decrypt = &info->decrypt_crypto;
+      if (save)
+        image->save_path = strdup("stdin.dec");
+    }
+    stlink_print(info, "Streaming firmware from stdin\n");
+    return 0;
+  }
+
+  if (info->jar) {
+    if (stlink_load_jar(info, filename, image, entry_name)) {
+      stlink_free_firmware(image);
+      return -1;
     }
-    printf("Decrypted Firmware\n");
+    filename = entry_name;
+  } else if (stlink_map_firmware(filename, image)) {
+    fprintf(stderr, "Opening File %s Failed\n", filename);
+    stlink_free_firmware(image);
+    return -1;
+  }
+  file_size = image->size;
+
+  stlink_print(info, "Loaded firmware : %s, size : %d bytes\n", filename, (int)file_size);
+  if (file_size > stlink_image_limit(info)) {
+    if (!ask) {
+      stlink_print(info, "Firmware Size is larger than Flash Size.\n");
+    } else {
+      printf("Firmware Size is larger than Flash Size. Continue? [Y/n]: ");
+      while (1) {
+        int c = getchar();
+        if (c != '\n')
+          while ((getchar()) != '\n');
+        if (c > 0)
+          c = tolower(c);
+        if (c == 'n') {
+          stlink_free_firmware(image);
+          return -1;
+        }
+        if (c == 'y' || c == '\n')
+          break;
+      }
+    }
+  }
+
+  if (decrypt) {
+    int padding = (16 - (file_size % 16)) % 16;
+
+    /* Firmware from a jar is already in a private, padded buffer */
+    if (!image->buffer) {
+      image->buffer = malloc(file_size + padding);
+      if (!image->buffer) {
+        stlink_free_firmware(image);
+        return -1;
+      }
+      memcpy(image->buffer, image->data, file_size);
+      memset(image->buffer + file_size, 0xFF, padding);
+      stlink_unmap_firmware(image);
+      image->data = image->buffer;
+    }
+
+    if (info->decrypt_key)
+      stlink_print(info, "Decrypting Firmware Using Key \"%s\"\n", info->decrypt_key);
+    else {
+      info->decrypt_key = "best performance";
+    }
+    crypto_init(&info->decrypt_crypto, (unsigned char*)info->decrypt_key);
+
+    crypto_decrypt_segments(&info->decrypt_crypto, image->buffer, file_size, info->threads);
+    stlink_print(info, "Decrypted Firmware\n");
 
     if (save) {
       char* dec_filename = malloc(strlen(filename) + 5);
       sprintf(dec_filename, "%s.dec", filename);
-      printf("Saving Decrypted Firmware as %s\n", dec_filename);
+      stlink_print(info, "Saving Decrypted Firmware as %s\n", dec_filename);
 
       FILE* fdw = fopen(dec_filename, "wb");
       if (fdw) {
-        fwrite(firmware, sizeof(unsigned char), file_size, fdw);
+        fwrite(image->buffer, sizeof(unsigned char), file_size, fdw);
         fclose(fdw);
       }
       free(dec_filename);
     }
   }
 
-  file_size += padding;
+  return 0;
+}
 
-  printf("Firmware Type %s\n\n",  (info->stinfo_bl_type == STLINK_BL_V3) ? "V3" : "V2");
-  unsigned int base_offset;
-  base_offset =  (info->stinfo_bl_type == STLINK_BL_V3) ? 0x08020000 : 0x08004000;
-  
-  unsigned int flashed_bytes = 0;
-  while (flashed_bytes < file_size) {
-    unsigned int cur_chunk_size;
-    if ((flashed_bytes + chunk_size) > file_size) {
-        cur_chunk_size = file_size - flashed_bytes;
-    } else {
-        cur_chunk_size = chunk_size;
+/* STLink V3 (STM32F723) flash sectors, the last entry is the end of flash */
+static const uint32_t v3_sector_start[] = {0x08000000, 0x08004000, 0x08008000, 0x0800C000,
+                                           0x08010000, 0x08020000, 0x08040000, 0x08060000,
+                                           0x08080000};
+#define V3_SECTOR_COUNT 8
+
+int stlink_plan_erase(struct ErasePlan *plan, enum BlTypes bl_type,
+      uint32_t start, uint32_t end, uint8_t flash_size, uint8_t reserved_flash) {
+  uint32_t address, flash_end;
+  int i;
+
+  plan->count = 0;
+  plan->bl_type = bl_type;
+  if (start >= end)
+    return 0;
+
+  if (bl_type == STLINK_BL_V3) {
+    flash_end = v3_sector_start[V3_SECTOR_COUNT];
+    if (end > flash_end) {
+      fprintf(stderr, "Image ends past the end of flash (0x%08x)\n", flash_end);
+      return -1;
     }
-    int wdl = 2;
-    if (info->stinfo_bl_type == STLINK_BL_V3) {
-      if (((base_offset + flashed_bytes) & ((1 << 14) - 1)) == 0) {
-        uint32_t sector_start[8] = {0x08000000, 0x08004000, 0x08008000, 0x0800C000, 0x08010000, 0x08020000, 0x08040000, 0x08060000};
-        int sector = -1;
-        int i = 0;
-        for (; i < 8; i++) {
-          if (sector_start[i] == base_offset + flashed_bytes) {
-              sector = i;
-              break;
-          }
-        }
-        if (i < 0) {
-          fprintf(stderr, "No sector match for address %08x\n", base_offset + flashed_bytes);
-          return i;
+    for (i = 0; i < V3_SECTOR_COUNT; i++) {
+      if (v3_sector_start[i + 1] <= start || v3_sector_start[i] >= end)
+        continue;
+      plan->op[plan->count].address = v3_sector_start[i];
+      plan->op[plan->count].size = v3_sector_start[i + 1] - v3_sector_start[i];
+      plan->op[plan->count].sector = i;
+      plan->count++;
+    }
+    return 0;
+  }
+
+  flash_end = 0x08000000 + ((uint32_t)flash_size << 10);
+  if (end > flash_end) {
+    fprintf(stderr, "Image ends past the end of flash (0x%08x)\n", flash_end);
+    return -1;
+  }
+  if (end > flash_end - ((uint32_t)(1 + reserved_flash) << 10))
+    printf("Warning: image overlaps the reserved area at the end of flash\n");
+
+  for (address = start & ~(STLINK_PAGE_SIZE - 1); address < end; address += STLINK_PAGE_SIZE) {
+    if (plan->count == ERASE_PLAN_MAX) {
+      fprintf(stderr, "Erase plan too large\n");
+      return -1;
+    }
+    plan->op[plan->count].address = address;
+    plan->op[plan->count].size = STLINK_PAGE_SIZE;
+    plan->op[plan->count].sector = -1;
+    plan->count++;
+  }
+
+  return 0;
+}
+
+int stlink_erase_run(struct STLinkInfo *info, const struct ErasePlan *plan) {
+  const char *unit = (plan->bl_type == STLINK_BL_V3) ? "sectors" : "pages";
+  uint64_t start = stlink_time_us();
+  unsigned int i;
+  int res;
+
+  for (i = 0; i < plan->count; i++) {
+    const struct EraseOp *op = &plan->op[i];
+
+    if (op->sector >= 0)
+      res = stlink_sector_erase(info, op->sector);
+    else
+      res = stlink_erase(info, op->address);
+    if (res) {
+      if (op->sector >= 0)
+        fprintf(stderr, "Erase Sector %d failed\n", op->sector);
+      else
+        fprintf(stderr, "Erase Error at 0x%08x\n", op->address);
+      return res;
+    }
+    if (!info->quiet) {
+      printf("Erasing %s: %u/%u\r", unit, i + 1, plan->count);
+      fflush(stdout);
+    }
+  }
+
+  stlink_print(info, "Erased %u %s in %.1f ms     \n", plan->count, unit, (stlink_time_us() - start) / 1000.0);
+  return 0;
+}
+
+/* Busy time of an operation: learned if possible, otherwise a typical value */
+static uint64_t stlink_estimate_busy(struct STLinkInfo *info, enum DFUOperation op,
+      enum BlTypes bl_type, uint32_t size) {
+  if (info->poll_profile.samples[op] && !(op == opERASE && bl_type == STLINK_BL_V3))
+    return info->poll_profile.busy_us[op];
+
+  switch (op) {
+  case opERASE:
+    /* STM32F723: ~250ms per 16KB sector, ~1s per 128KB sector */
+    if (bl_type == STLINK_BL_V3)
+      return size <= 0x4000 ? 250000 : (size <= 0x10000 ? 550000 : 1000000);
+    return 22000;
+  case opWRITE:
+    /* 2KB chunk: 1024 half-words on STM32F103, 512 words on STM32F723 */
+    return (bl_type == STLINK_BL_V3) ? 9000 : 55000;
+  default:
+    return 500;
+  }
+}
+
+int stlink_flash_plan(struct STLinkInfo *info, const char *filename, bool decrypt) {
+  struct ErasePlan plan;
+  struct FirmwareImage image;
+  uint32_t file_size, erase_size;
+  unsigned int chunk_size = STLINK_CHUNK_SIZE;
+  unsigned int offset, writes = 0, set_addresses = 0, i;
+  uint64_t erase_us = 0, write_us, total_us;
+  int res;
+
+  if (stlink_load_firmware(info, filename, decrypt, false, false, &image))
+    return -1;
+  stlink_image_fetch(info, &image, UINT32_MAX);
+  /* Streamed images can only be checked once they are complete */
+  if (image.stream && image.size > stlink_image_limit(info))
+    printf("Firmware Size is larger than Flash Size.\n");
+  erase_size = (image.size + 15) & ~15;
+  file_size = stlink_sparse_trim(info, &image, erase_size);
+
+  uint32_t base_offset = stlink_base_offset(info->stinfo_bl_type);
+  res = stlink_plan_erase(&plan, info->stinfo_bl_type, base_offset, base_offset + erase_size,
+                          info->flash_size, info->reserved_flash);
+  if (res) {
+    stlink_free_firmware(&image);
+    return res;
+  }
+
+  for (offset = stlink_next_chunk(info, &image, 0, file_size); offset < file_size;
+       offset = stlink_next_chunk(info, &image, offset + chunk_size, file_size))
+    writes++;
+  stlink_free_firmware(&image);
+  set_addresses = (info->block_addressing && info->stinfo_bl_type != STLINK_BL_V3) ? (writes ? 1 : 0) : writes;
+
+  printf("Erase plan for 0x%08x-0x%08x:\n", base_offset, base_offset + erase_size);
+  for (i = 0; i < plan.count; i++) {
+    if (plan.op[i].sector >= 0) {
+      printf("  sector %d at 0x%08x (%u KB)\n", plan.op[i].sector, plan.op[i].address, plan.op[i].size >> 10);
+    } else if (i == 0 || plan.op[i - 1].address + plan.op[i - 1].size != plan.op[i].address) {
+      /* Pages are listed as runs of contiguous pages */
+      unsigned int run = 1;
+      while (i + run < plan.count && plan.op[i + run].address == plan.op[i].address + run * plan.op[i].size)
+        run++;
+      printf("  %u pages at 0x%08x-0x%08x (%u KB each)\n", run, plan.op[i].address,
+             plan.op[i].address + run * plan.op[i].size - 1, plan.op[i].size >> 10);
+    }
+    erase_us += stlink_estimate_busy(info, opERASE, plan.bl_type, plan.op[i].size) + 3 * USB_REQUEST_US;
+  }
+
+  write_us = writes * (stlink_estimate_busy(info, opWRITE, plan.bl_type, chunk_size) + 3 * USB_REQUEST_US) +
+             set_addresses * (stlink_estimate_busy(info, opSET_ADDRESS, plan.bl_type, 0) + 3 * USB_REQUEST_US);
+  total_us = erase_us + write_us;
+
+  printf("\n%u erases, %u chunk downloads, %u SET_ADDRESS\n", plan.count, writes, set_addresses);
+  printf("Estimated erase time: %.1f ms\n", erase_us / 1000.0);
+  printf("Estimated write time: %.1f ms\n", write_us / 1000.0);
+  printf("Estimated total:      %.1f ms\n", total_us / 1000.0);
+
+  return 0;
+}
+
+/* Queues an upload of len bytes, the address follows the same rules as downloads */
+static int stlink_upload_submit(struct STLinkInfo *info,
+      struct DFUUpload *upload,
+      uint32_t offset,
+      size_t len,
+      const uint16_t wBlockNum,
+      unsigned int timeout) {
+  memset(upload->request, 0, sizeof(upload->request));
+
+  upload->request[0] = ST_DFU_MAGIC;
+  upload->request[1] = DFU_UPLOAD;
+  *(uint16_t*)(upload->request+2) = wBlockNum; /* wValue */
+  *(uint16_t*)(upload->request+6) = len; /* wLength */
+  upload->offset = offset;
+  upload->data_len = len;
+
+  return stlink_transfer_submit(info, &upload->xfer, upload->request,
+                                info->stinfo_ep_in, upload->data, len, timeout);
+}
+
+/* Points the bootloader at address and leaves it idle, ready for uploads */
+static int stlink_upload_start(struct STLinkInfo *info, uint32_t address) {
+  int res;
+
+  res = stlink_set_address(info, address);
+  if (res) {
+    fprintf(stderr, "Set Address Error at 0x%08x\n", address);
+    return res;
+  }
+  return stlink_dfu_abort(info);
+}
+
+/*
+ * Reads len bytes of flash at address with a single DFU_UPLOAD, waiting at
+ * most timeout ms for the data. Returns 1 if the bootloader does not support
+ * uploads.
+ */
+static int stlink_read_flash(struct STLinkInfo *info, uint32_t address, unsigned char *data, size_t len,
+      unsigned int timeout) {
+  struct DFUUpload upload;
+  int res;
+
+  res = stlink_upload_start(info, address);
+  if (!res)
+    res = stlink_upload_submit(info, &upload, 0, len, 2, timeout);
+  if (res)
+    return res;
+
+  if (stlink_transfer_wait(info, &upload.xfer)) {
+    if (upload.xfer.status == LIBUSB_TRANSFER_STALL)
+      info->transport.ops->clear_halt(&info->transport, info->stinfo_ep_in);
+    if (upload.xfer.status != LIBUSB_TRANSFER_NO_DEVICE) {
+      stlink_dfu_clrstatus(info);
+      return 1;
+    }
+    fprintf(stderr, "Read-back failure at 0x%08x\n", address);
+    return -1;
+  }
+  memcpy(data, upload.data, len);
+
+  return stlink_dfu_abort(info);
+}
+
+/*
+ * Reads back the chunks at offsets[] with DFU_UPLOAD and compares them with
+ * the image. With block addressing the read of the next chunk is queued
+ * before the current one is compared. Chunks that differ are stored in
+ * bad[]. Returns 1 if the bootloader does not support uploads.
+ */
+static int stlink_verify_chunks(struct STLinkInfo *info, const struct FirmwareImage *image,
+      uint32_t base_offset, uint32_t size, const uint32_t *offsets, unsigned int count,
+      bool block_addressing, uint32_t *bad, unsigned int *bad_count) {
+  struct DFUUpload upload[2];
+  unsigned char expected[STLINK_CHUNK_SIZE];
+  unsigned int i;
+  int cur = 0, res;
+
+  *bad_count = 0;
+  if (!count)
+    return 0;
+
+  res = stlink_upload_start(info, base_offset + offsets[0]);
+  if (!res)
+    res = stlink_upload_submit(info, &upload[cur], offsets[0], min(STLINK_CHUNK_SIZE, size - offsets[0]), 2,
+                               USB_TIMEOUT);
+  if (res)
+    return res;
+
+  for (i = 0; i < count; i++) {
+    if (stlink_transfer_wait(info, &upload[cur].xfer)) {
+      if (upload[cur].xfer.status == LIBUSB_TRANSFER_STALL)
+        info->transport.ops->clear_halt(&info->transport, info->stinfo_ep_in);
+      if (i == 0 && upload[cur].xfer.status != LIBUSB_TRANSFER_NO_DEVICE) {
+        stlink_dfu_clrstatus(info);
+        return 1;
+      }
+      fprintf(stderr, "Read-back failure at 0x%08x\n", base_offset + upload[cur].offset);
+      return -1;
+    }
+
+    if (i + 1 < count && block_addressing) {
+      res = stlink_upload_submit(info, &upload[!cur], offsets[i + 1],
+                                 min(STLINK_CHUNK_SIZE, size - offsets[i + 1]),
+                                 2 + (offsets[i + 1] - offsets[0]) / STLINK_CHUNK_SIZE, USB_TIMEOUT);
+      if (res)
+        return res;
+    }
+
+    stlink_image_chunk(image, upload[cur].offset, upload[cur].data_len, expected);
+    if (memcmp(expected, upload[cur].data, upload[cur].data_len))
+      bad[(*bad_count)++] = upload[cur].offset;
+
+    if (i + 1 < count && !block_addressing) {
+      /* SET_ADDRESS is a download, leave dfuUPLOAD_IDLE first */
+      res = stlink_dfu_abort(info);
+      if (!res)
+        res = stlink_upload_start(info, base_offset + offsets[i + 1]);
+      if (!res)
+        res = stlink_upload_submit(info, &upload[!cur], offsets[i + 1],
+                                   min(STLINK_CHUNK_SIZE, size - offsets[i + 1]), 2, USB_TIMEOUT);
+      if (res)
+        return res;
+    }
+    cur = !cur;
+  }
+
+  return stlink_dfu_abort(info);
+}
+
+/* Erases and writes a single chunk, used to repair chunks that failed verification */
+static int stlink_write_chunk(struct STLinkInfo *info, const struct FirmwareImage *image,
+      uint32_t base_offset, uint32_t offset, size_t len) {
+  struct DFUDownload download;
+  int wdl = 2;
+  int res;
+
+  if (info->stinfo_bl_type == STLINK_BL_V3 && ((base_offset + offset) & ((1 << 14) - 1)))
+    wdl = 3;
+
+  res = stlink_set_address(info, base_offset + offset);
+  if (res) {
+    fprintf(stderr, "Set Address Error at 0x%08x\n", base_offset + offset);
+    return res;
+  }
+  stlink_dfu_prepare_chunk(info, &download, image, offset, len);
+  res = stlink_dfu_submit(info, &download, wdl);
+  if (!res)
+    res = stlink_dfu_wait(info, &download);
+  if (!res)
+    res = stlink_dfu_finish(info, opWRITE);
+  if (res)
+    fprintf(stderr, "Download Error at 0x%08x\n", base_offset + offset);
+  return res;
+}
+
+/*
+ * Verifies every written chunk of the image. Chunks that differ are
+ * rewritten in place: the pages or sectors holding them are erased and
+ * the written chunks inside those are downloaded again.
+ */
+static int stlink_verify(struct STLinkInfo *info, struct FirmwareImage *image,
+      uint32_t base_offset, uint32_t size, bool block_addressing) {
+  struct ErasePlan plan, chunk_plan;
+  uint32_t *offsets, *bad, *rewrite;
+  unsigned int count = 0, bad_count = 0, rewrite_count = 0, i, j, k;
+  uint32_t offset;
+  uint64_t start = stlink_time_us();
+  int res;
+
+  offsets = malloc(3 * sizeof(uint32_t) * (size / STLINK_CHUNK_SIZE + 1));
+  if (!offsets)
+    return -1;
+  bad = offsets + (size / STLINK_CHUNK_SIZE + 1);
+  rewrite = bad + (size / STLINK_CHUNK_SIZE + 1);
+
+  for (offset = stlink_next_chunk(info, image, 0, size); offset < size;
+       offset = stlink_next_chunk(info, image, offset + STLINK_CHUNK_SIZE, size))
+    offsets[count++] = offset;
+
+  res = stlink_verify_chunks(info, image, base_offset, size, offsets, count,
+                             block_addressing, bad, &bad_count);
+  if (res == 1) {
+    stlink_print(info, "Bootloader doesn't support read-back, firmware not verified\n");
+    res = 0;
+    goto exit;
+  }
+  if (res)
+    goto exit;
+
+  if (bad_count) {
+    stlink_print(info, "Verify: %u chunks differ, rewriting them\n", bad_count);
+
+    plan.bl_type = info->stinfo_bl_type;
+    plan.count = 0;
+    for (i = 0; i < bad_count; i++) {
+      res = stlink_plan_erase(&chunk_plan, info->stinfo_bl_type, base_offset + bad[i],
+                              base_offset + bad[i] + min(STLINK_CHUNK_SIZE, size - bad[i]),
+                              info->flash_size, info->reserved_flash);
+      if (res)
+        goto exit;
+      for (j = 0; j < chunk_plan.count; j++) {
+        for (k = 0; k < plan.count; k++) {
+          if (plan.op[k].address == chunk_plan.op[j].address)
+            break;
         }
-        printf("Erase Sector %d\n", sector);
-        res = stlink_sector_erase(info, sector);
-        if (res) {
-          fprintf(stderr, "Erase Sector %d failed\n", sector);
-          return res;
+        if (k == plan.count && plan.count < ERASE_PLAN_MAX)
+          plan.op[plan.count++] = chunk_plan.op[j];
+      }
+    }
+    res = stlink_erase_run(info, &plan);
+    if (res)
+      goto exit;
+
+    /* An erased sector may hold more chunks than the ones that differ */
+    for (i = 0; i < count; i++) {
+      for (k = 0; k < plan.count; k++) {
+        if (base_offset + offsets[i] < plan.op[k].address + plan.op[k].size &&
+            base_offset + offsets[i] + STLINK_CHUNK_SIZE > plan.op[k].address)
+          break;
+      }
+      if (k == plan.count)
+        continue;
+      res = stlink_write_chunk(info, image, base_offset, offsets[i],
+                               min(STLINK_CHUNK_SIZE, size - offsets[i]));
+      if (res)
+        goto exit;
+      rewrite[rewrite_count++] = offsets[i];
+    }
+
+    res = stlink_verify_chunks(info, image, base_offset, size, rewrite, rewrite_count,
+                               false, bad, &bad_count);
+    if (!res && bad_count) {
+      fprintf(stderr, "Verify failed at 0x%08x\n", base_offset + bad[0]);
+      res = -1;
+    }
+    if (res)
+      goto exit;
+  }
+
+  stlink_print(info, "Verified %u chunks in %.1f ms, %u rewritten\n", count,
+         (stlink_time_us() - start) / 1000.0, rewrite_count);
+
+exit:
+  free(offsets);
+  return res;
+}
+
+int stlink_flash(struct STLinkInfo *info, const char *filename, bool decrypt, bool save) {
+  struct ErasePlan plan;
+  struct FirmwareImage image;
+  uint32_t file_size, erase_size;
+  unsigned int chunk_size = STLINK_CHUNK_SIZE;
+  uint64_t timing_start = TIMING_BEGIN();
+  int res = 0;
+
+  if (stlink_load_firmware(info, filename, decrypt, save, !info->quiet, &image))
+    return -1;
+  TIMING_END(tmLOAD, timing_start);
+
+  if (image.stream) {
+    /* The size is only known at the end of the stream */
+    file_size = erase_size = UINT32_MAX;
+  } else {
+    erase_size = (image.size + 15) & ~15;
+    file_size = stlink_sparse_trim(info, &image, erase_size);
+  }
+
+  stlink_print(info, "Firmware Type %s\n\n",  (info->stinfo_bl_type == STLINK_BL_V3) ? "V3" : "V2");
+  unsigned int base_offset = stlink_base_offset(info->stinfo_bl_type);
+  uint32_t erased_end = base_offset;
+
+  /*
+   * V2 bootloaders follow DfuSe addressing: a download with wBlockNum >= 2
+   * is written to address pointer + (wBlockNum - 2) * chunk size. The pointer
+   * is set once and following chunks only bump the block number. An erase
+   * may move the pointer, so it is set again after each erase phase.
+   * V3 bootloaders use wBlockNum differently and keep the per-chunk path.
+   * It is opt-in: a bootloader that ignores wBlockNum writes a chunk over
+   * the previous one, and on F1 parts that does not always fail.
+   */
+  bool block_addressing = info->block_addressing && info->stinfo_bl_type != STLINK_BL_V3;
+  unsigned int stream_block = 0;
+  unsigned int skipped_set_address = 0;
+
+  /*
+   * Chunks are double buffered: the next chunk is encrypted and its
+   * request built while the current one is on the wire.
+   */
+  struct DFUDownload download[2];
+  int cur = 0;
+  unsigned int skipped_chunks = 0;
+
+  unsigned int flashed_bytes = stlink_next_chunk(info, &image, 0, file_size);
+  unsigned int cur_chunk_size = stlink_chunk_len(info, &image, flashed_bytes, file_size);
+  if (!cur_chunk_size) {
+    /* Nothing to write, the pages of the image are still erased */
+    if (image.stream) {
+      erase_size = (stlink_image_fetch(info, &image, UINT32_MAX) + 15) & ~15;
+      if (image.size > stlink_image_limit(info)) {
+        fprintf(stderr, "Firmware Size is larger than Flash Size.\n");
+        res = -1;
+        goto exit;
+      }
+    }
+    res = stlink_plan_erase(&plan, info->stinfo_bl_type, base_offset, base_offset + erase_size,
+                            info->flash_size, info->reserved_flash);
+    if (!res)
+      res = stlink_erase_run(info, &plan);
+    if (!res)
+      stlink_print(info, "Firmware is blank, erased without downloads\n");
+    goto exit;
+  }
+  stlink_dfu_prepare_chunk(info, &download[cur], &image, flashed_bytes, cur_chunk_size);
+
+  uint64_t poll_sleep_us = info->poll_sleep_us;
+  uint64_t poll_timeout_us = info->poll_timeout_us;
+
+  while (cur_chunk_size) {
+    int wdl = 2;
+
+    if (base_offset + flashed_bytes + cur_chunk_size > erased_end) {
+      /*
+       * Files are erased in one phase before the first download. Streams
+       * are erased as data comes in, a window at a time.
+       */
+      uint32_t erase_end = erase_size;
+      if (image.stream) {
+        erase_end = stlink_image_fetch(info, &image, flashed_bytes + STREAM_ERASE_AHEAD);
+        /* Streams are checked as they come in, nothing past the limit is erased or written */
+        if (erase_end > stlink_image_limit(info)) {
+          fprintf(stderr, "Firmware Size is larger than Flash Size.\n");
+          res = -1;
+          goto exit;
         }
-        printf("Erase Sector %d done\n", sector);
-      } else {
-          wdl = 3;
+        erase_end = max((erase_end + 15) & ~15, flashed_bytes + cur_chunk_size);
       }
+      res = stlink_plan_erase(&plan, info->stinfo_bl_type, erased_end, base_offset + erase_end,
+                              info->flash_size, info->reserved_flash);
+      if (!res)
+        res = stlink_erase_run(info, &plan);
+      if (res)
+        goto exit;
+      if (plan.count)
+        erased_end = plan.op[plan.count - 1].address + plan.op[plan.count - 1].size;
+      stream_block = 0;
+    }
+
+    unsigned int next_offset = stlink_next_chunk(info, &image, flashed_bytes + cur_chunk_size, file_size);
+    unsigned int next_chunk_size = stlink_chunk_len(info, &image, next_offset, file_size);
+    /* Blank chunks skipped in sparse mode, the erase already left them at 0xFF */
+    unsigned int skipped = (next_offset - flashed_bytes - cur_chunk_size) / chunk_size;
+
+    /* V3 expects block 2 at the start of each 16KB block and 3 elsewhere */
+    if (info->stinfo_bl_type == STLINK_BL_V3 && ((base_offset + flashed_bytes) & ((1 << 14) - 1)))
+      wdl = 3;
+
+    if (block_addressing && stream_block > 2 && stream_block <= 0xFFFF) {
+      wdl = stream_block;
+      skipped_set_address++;
     } else {
-      res = stlink_erase(info, base_offset + flashed_bytes);
+      res = stlink_set_address(info, base_offset+flashed_bytes);
       if (res) {
-        fprintf(stderr, "Erase Error at 0x%08x\n", base_offset + flashed_bytes);
-        return res;
+        fprintf(stderr, "Set Address Error at 0x%08x\n", base_offset + flashed_bytes);
+        goto exit;
+      } else {
+        //printf("set address to 0x%08x done\n", base_offset + flashed_bytes);
       }
+      stream_block = 2;
     }
-    res = stlink_set_address(info, base_offset+flashed_bytes);
-    if (res) {
-      fprintf(stderr, "Set Address Error at 0x%08x\n", base_offset + flashed_bytes);
-      return res;
-    } else {
-      //printf("set address to 0x%08x done\n", base_offset + flashed_bytes);
+    res = stlink_dfu_submit(info, &download[cur], wdl);
+    if (!res) {
+      if (next_chunk_size)
+        stlink_dfu_prepare_chunk(info, &download[!cur], &image, next_offset, next_chunk_size);
+      res = stlink_dfu_wait(info, &download[cur]);
+    }
+    if (!res)
+      res = stlink_dfu_finish(info, opWRITE);
+    if (res < -1 && wdl > 2 && block_addressing) {
+      /* Bootloader rejected the block number, go back to one SET_ADDRESS per chunk */
+      stlink_print(info, "Bootloader rejected block addressing, falling back to per-chunk addressing\n");
+      block_addressing = false;
+      skipped_set_address--;
+      res = stlink_dfu_clrstatus(info);
+      if (!res)
+        res = stlink_set_address(info, base_offset + flashed_bytes);
+      if (res) {
+        fprintf(stderr, "Set Address Error at 0x%08x\n", base_offset + flashed_bytes);
+        goto exit;
+      }
+      stlink_dfu_prepare_chunk(info, &download[cur], &image, flashed_bytes, cur_chunk_size);
+      res = stlink_dfu_submit(info, &download[cur], 2);
+      if (!res)
+        res = stlink_dfu_wait(info, &download[cur]);
+      if (!res)
+        res = stlink_dfu_finish(info, opWRITE);
+      if (!res && next_chunk_size)
+        stlink_dfu_prepare_chunk(info, &download[!cur], &image, next_offset, next_chunk_size);
     }
-    res = stlink_dfu_download(info, firmware + flashed_bytes, cur_chunk_size, wdl);
     if (res) {
       fprintf(stderr, "Download Error at 0x%08x\n", base_offset + flashed_bytes);
-      return res;
-    } else {
-      printf("Download at 0x%08x done. %.1f%%\r", base_offset + flashed_bytes, ((float)(flashed_bytes + cur_chunk_size) / file_size) * 100.0);
+      goto exit;
+    } else if (!info->quiet) {
+      if (image.stream)
+        printf("Download at 0x%08x done. %u bytes\r", base_offset + flashed_bytes, flashed_bytes + cur_chunk_size);
+      else
+        printf("Download at 0x%08x done. %.1f%%\r", base_offset + flashed_bytes, ((float)(flashed_bytes + cur_chunk_size) / file_size) * 100.0);
+      fflush(stdout); /* Flush stdout buffer */
     }
 
-    fflush(stdout); /* Flush stdout buffer */
-
-    flashed_bytes += cur_chunk_size;
+    skipped_chunks += skipped;
+    stream_block += 1 + skipped;
+    flashed_bytes = next_offset;
+    cur_chunk_size = next_chunk_size;
+    cur = !cur;
   }
 
-  free(firmware);
-  fclose(fd);
-
-  printf("Downloaded Firmware File            \n");
+  stlink_print(info, "Downloaded Firmware File            \n");
+  info->skipped_set_address += skipped_set_address;
+  if (skipped_set_address)
+    stlink_print(info, "Block addressing saved %u SET_ADDRESS requests (%u round-trips)\n",
+           skipped_set_address, skipped_set_address * 3);
+  if (skipped_chunks)
+    stlink_print(info, "Sparse: skipped %u blank chunks (%u bytes)\n", skipped_chunks, skipped_chunks * chunk_size);
+  stlink_print(info, "Poll wait: %.1f ms (bootloader requested %.1f ms)\n",
+         (info->poll_sleep_us - poll_sleep_us) / 1000.0,
+         (info->poll_timeout_us - poll_timeout_us) / 1000.0);
+
+  if (info->verify) {
+    if (image.stream)
+      file_size = (image.size + 15) & ~15;
+    timing_start = TIMING_BEGIN();
+    res = stlink_verify(info, &image, base_offset, file_size, block_addressing);
+    TIMING_END(tmVERIFY, timing_start);
+  }
 
-  return 0;
+exit:
+  stlink_free_firmware(&image);
+  return res;
 }
 
 int stlink_exit_dfu(struct STLinkInfo *info) {
@@ -955,7 +2413,7 @@ int stlink_exit_dfu(struct STLinkInfo *info) {
   data[0] = ST_DFU_MAGIC;
   data[1] = DFU_EXIT;
   
-  res = libusb_bulk_transfer(info->stinfo_dev_handle,
+  res = stlink_bulk_transfer(info,
            info->stinfo_ep_out,
            data,
            16,
@@ -967,3 +2425,100 @@ int stlink_exit_dfu(struct STLinkInfo *info) {
   }
   return 0;
 }
+
+/* Path of the poll profile, -1 if there is none or STLINK_TOOL_POLL_PROFILE is empty */
+static int stlink_poll_path(char *path, size_t len) {
+  const char *home, *profile = getenv("STLINK_TOOL_POLL_PROFILE");
+
+  if (profile) {
+    if (!profile[0])
+      return -1;
+    snprintf(path, len, "%s", profile);
+    return 0;
+  }
+#ifdef WINDOWS
+  home = getenv("USERPROFILE");
+#else
+  home = getenv("HOME");
+#endif
+  if (!home)
+    return -1;
+  snprintf(path, len, "%s/%s", home, POLL_PROFILE_FILE);
+  return 0;
+}
+
+/*
+ * The poll profile is a text file with one "pid operation busy_us samples"
+ * line per bootloader PID and operation.
+ */
+int stlink_poll_load(struct STLinkInfo *info) {
+  char path[1024], line[128];
+  unsigned int pid, op, busy_us, samples;
+  FILE *fd;
+
+  memset(&info->poll_profile, 0, sizeof(info->poll_profile));
+  if (stlink_poll_path(path, sizeof(path)))
+    return -1;
+
+  fd = fopen(path, "r");
+  if (fd == NULL)
+    return -1;
+
+  while (fgets(line, sizeof(line), fd)) {
+    if (sscanf(line, "%x %u %u %u", &pid, &op, &busy_us, &samples) != 4)
+      continue;
+    if (pid != info->bootloader_pid || op >= opCOUNT)
+      continue;
+    info->poll_profile.busy_us[op] = busy_us;
+    info->poll_profile.samples[op] = samples;
+  }
+  fclose(fd);
+
+  return 0;
+}
+
+int stlink_poll_save(struct STLinkInfo *info) {
+  char path[1024], line[128];
+  char *others = NULL;
+  size_t others_len = 0;
+  unsigned int pid, op, busy_us, samples;
+  FILE *fd;
+
+  if (stlink_poll_path(path, sizeof(path)))
+    return -1;
+
+  /* Keep the entries of other bootloaders */
+  fd = fopen(path, "r");
+  if (fd) {
+    while (fgets(line, sizeof(line), fd)) {
+      if (sscanf(line, "%x %u %u %u", &pid, &op, &busy_us, &samples) != 4 ||
+          pid == info->bootloader_pid)
+        continue;
+      char *tmp = realloc(others, others_len + strlen(line) + 1);
+      if (!tmp)
+        break;
+      others = tmp;
+      strcpy(others + others_len, line);
+      others_len += strlen(line);
+    }
+    fclose(fd);
+  }
+
+  fd = fopen(path, "w");
+  if (fd == NULL) {
+    free(others);
+    return -1;
+  }
+  if (others)
+    fputs(others, fd);
+  for (op = 0; op < opCOUNT; op++) {
+    if (info->poll_profile.samples[op])
+      fprintf(fd, "%04x %u %u %u\n", info->bootloader_pid, op,
+              info->poll_profile.busy_us[op], info->poll_profile.samples[op]);
+  }
+  fclose(fd);
+  free(others);
+
+  return 0;
+}
+
@@ -26,6 +26,10 @@
 #include <unistd.h>
 #include <libusb.h>
 
+#include "crypto.h"
+#include "jar.h"
+#include "transport.h"
+
 #ifdef WINDOWS
   #ifndef bool
     #define bool unsigned char
@@ -80,6 +84,13 @@ enum BlTypes {
     STLINK_BL_V3
 };
 
+enum DFUOperation {
+  opERASE = 0,
+  opSET_ADDRESS,
+  opWRITE,
+  opCOUNT
+};
+
 enum ConfigTypes {
   confVERSION = 0,
   confST_TYPE,
@@ -119,6 +130,91 @@ struct DFUStatus {
   unsigned char iString : 8;
 };
 
+#define DFU_DETACH 0x00
+#define DFU_DNLOAD 0x01
+#define DFU_UPLOAD 0x02
+#define DFU_GETSTATUS 0x03
+#define DFU_CLRSTATUS 0x04
+#define DFU_GETSTATE 0x05
+#define DFU_ABORT 0x06
+#define DFU_EXIT  0x07
+#define ST_DFU_INFO   0xF1
+#define ST_DFU_MAGIC  0xF3
+
+#define GET_COMMAND 0x00
+#define SET_ADDRESS_POINTER_COMMAND 0x21
+#define ERASE_COMMAND 0x41
+#define ERASE_SECTOR_COMMAND 0x42
+#define READ_UNPROTECT_COMMAND 0x92
+
+#define STLINK_VID        0x0483
+#define STLINK_PID        0x3748
+#define STLINK_PIDV21     0x374b
+#define STLINK_PIDV21_MSD 0x3752
+#define STLINK_PIDV3      0x374f
+#define STLINK_PIDV3_BL   0x374d
+
+/* Default and largest bound of the wait for a bootloader to enumerate */
+#define ENUM_TIMEOUT_MS   5000
+#define ENUM_TIMEOUT_MAX_MS 600000
+
+/* Physical location of a device, kept across re-enumeration */
+struct USBPortPath {
+  uint8_t bus;
+  uint8_t depth;
+  uint8_t ports[7];
+};
+
+/* Largest DNLOAD payload, firmware is sent in chunks of this size */
+#define STLINK_CHUNK_SIZE 0x800
+
+/* Flash page erased by ERASE_COMMAND on V2 bootloaders (STM32F103) */
+#define STLINK_PAGE_SIZE 0x400
+#define ERASE_PLAN_MAX 256
+
+struct EraseOp {
+  uint32_t address;
+  uint32_t size;
+  int sector; /* sector number on V3, -1 for a page erase */
+};
+
+struct ErasePlan {
+  enum BlTypes bl_type;
+  unsigned int count;
+  struct EraseOp op[ERASE_PLAN_MAX];
+};
+
+/*
+ * Firmware file being flashed. Plain images are mapped read-only, so
+ * processes flashing the same file share its pages. A decrypted image
+ * lives in a private buffer. Images read from stdin are fetched as the
+ * flash loop needs them.
+ */
+struct FirmwareImage {
+  const uint8_t *data;
+  uint32_t size;
+  void *map;
+  size_t map_size;
+  uint8_t *buffer;
+  /* Streamed images (stdin) grow in buffer as they are read */
+  FILE *stream;
+  bool eof;
+  uint32_t capacity;
+  uint32_t decrypted;
+  const struct CryptoCtx *decrypt;
+  char *save_path;
+#ifdef WINDOWS
+  void *file_handle;
+  void *map_handle;
+#endif
+};
+
+/* Learned bootloader busy time per operation, see stlink_poll_load() */
+struct DFUPollProfile {
+  uint32_t busy_us[opCOUNT];
+  uint32_t samples[opCOUNT];
+};
+
 struct STLinkInfo {
   uint8_t firmware_key[16];
   uint8_t anti_clone[16];
@@ -147,12 +243,39 @@ struct STLinkInfo {
   uint8_t reported_flash_size;
   uint8_t reserved_flash;
   uint8_t mode;
+  /* config.raw_config was reported by the bootloader, see stlink_read_info() */
+  bool has_dev_config;
   libusb_context *stinfo_usb_ctx;
   libusb_device_handle *stinfo_dev_handle;
   unsigned char stinfo_ep_in;
   unsigned char stinfo_ep_out;
   enum BlTypes stinfo_bl_type;
+  /* libusb for the dongle, loopback to the emulator with --emulate */
+  struct Transport transport;
   char* decrypt_key;
+  /* Key schedules of firmware_key and decrypt_key, expanded once per session */
+  struct CryptoCtx firmware_crypto;
+  struct CryptoCtx decrypt_crypto;
+  bool sparse;
+  /* DfuSe wBlockNum addressing on V2, opt-in, see stlink_flash() */
+  bool block_addressing;
+  bool verify;
+  /* Write the config area field by field instead of as one page */
+  bool stepwise_config;
+  bool quiet;
+  unsigned int threads;
+  /* Firmware comes from STLinkUpgrade.jar, see stlink_load_jar() */
+  bool jar;
+  /* The jar inflated once for all gang workers, see stlink_jar_open() */
+  const struct JarFiles *jar_files;
+  const char *jar_entry;
+  char jar_type;
+  uint64_t enum_timeout_us;
+  struct DFUPollProfile poll_profile;
+  uint64_t poll_sleep_us;
+  uint64_t poll_timeout_us;
+  /* SET_ADDRESS requests left out by block addressing */
+  uint32_t skipped_set_address;
 };
 
 extern char* st_types[];
@@ -161,13 +284,26 @@ int stlink_flash_config_area(struct STLinkInfo *info, struct STLinkConfig *confi
 char* stlink_get_dev_config(struct STLinkConfig *config, enum ConfigTypes config_type);
 
 int stlink_dfu_mode(libusb_device_handle *dev_handle, int trigger);
+int stlink_port_path(libusb_device *dev, struct USBPortPath *path);
+int stlink_wait_bootloader(libusb_context *usb_ctx, const struct USBPortPath *paths,
+      unsigned int count, uint64_t timeout_us, uint64_t *latency_us);
 int stlink_read_info(struct STLinkInfo *info);
 int stlink_current_mode(struct STLinkInfo *info);
 int stlink_dfu_download(struct STLinkInfo *stlink_info,
-			unsigned char *data,
+			const unsigned char *data,
 			const size_t data_len,
 			const uint16_t wBlockNum);
+int stlink_plan_erase(struct ErasePlan *plan, enum BlTypes bl_type,
+      uint32_t start, uint32_t end, uint8_t flash_size, uint8_t reserved_flash);
+int stlink_erase_run(struct STLinkInfo *info, const struct ErasePlan *plan);
+void stlink_free_firmware(struct FirmwareImage *image);
+int stlink_jar_open(const char *jar_path, struct JarFiles *files);
+int stlink_flash_plan(struct STLinkInfo *info, const char *filename, bool decrypt);
 int stlink_flash(struct STLinkInfo *stlink_info, const char *filename, bool decrypt, bool save);
 int stlink_exit_dfu(struct STLinkInfo *info);
+int stlink_poll_load(struct STLinkInfo *info);
+int stlink_poll_save(struct STLinkInfo *info);
+uint64_t stlink_time_us(void);
+uint16_t stlink_checksum(const unsigned char *firmware, size_t len);
 
 #endif //_STLINK_H
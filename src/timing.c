@@ -0,0 +1,126 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "timing.h"
+
+bool timing_enabled = false;
+
+static const char *timing_names[tmCOUNT] = {
+  [tmSESSION] = "session",
+  [tmENUMERATE] = "enumerate",
+  [tmDFU_SWITCH] = "dfu_switch",
+  [tmREAD_INFO] = "read_info",
+  [tmLOAD] = "load",
+  [tmERASE] = "erase",
+  [tmSET_ADDRESS] = "set_address",
+  [tmWRITE] = "write",
+  [tmTRANSFER] = "transfer",
+  [tmPOLL_SLEEP] = "poll_sleep",
+  [tmVERIFY] = "verify",
+  [tmCONFIG] = "config",
+  [tmEXIT_DFU] = "exit_dfu",
+};
+
+/* Every sample is kept for the percentiles, a session has a few thousand */
+struct TimingSamples {
+  uint64_t *us;
+  unsigned int count;
+  unsigned int capacity;
+  uint64_t total;
+};
+
+static struct TimingSamples timing_samples[tmCOUNT];
+/* Gang mode records from several threads */
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void timing_record(enum TimingPhase phase, uint64_t elapsed_us) {
+  struct TimingSamples *samples = &timing_samples[phase];
+
+  pthread_mutex_lock(&timing_lock);
+  if (samples->count == samples->capacity) {
+    unsigned int capacity = samples->capacity ? samples->capacity * 2 : 64;
+    uint64_t *us = realloc(samples->us, capacity * sizeof(*us));
+    if (!us) {
+      pthread_mutex_unlock(&timing_lock);
+      return;
+    }
+    samples->us = us;
+    samples->capacity = capacity;
+  }
+  samples->us[samples->count++] = elapsed_us;
+  samples->total += elapsed_us;
+  pthread_mutex_unlock(&timing_lock);
+}
+
+static int timing_compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted samples */
+static uint64_t timing_percentile(const struct TimingSamples *samples, unsigned int percent) {
+  unsigned int rank = (samples->count * percent + 99) / 100;
+
+  return samples->us[rank ? rank - 1 : 0];
+}
+
+void timing_report(bool json) {
+  struct TimingSamples *samples;
+  bool first = true;
+  int phase;
+
+  if (json)
+    printf("{\"timings\": {");
+  else
+    printf("\n%-12s %7s %11s %10s %10s %10s %10s\n", "Phase", "Count", "Total ms",
+           "Min ms", "Max ms", "p50 ms", "p99 ms");
+
+  for (phase = 0; phase < tmCOUNT; phase++) {
+    samples = &timing_samples[phase];
+    if (!samples->count)
+      continue;
+    qsort(samples->us, samples->count, sizeof(*samples->us), timing_compare);
+
+    if (json) {
+      printf("%s\n  \"%s\": {\"count\": %u, \"total_us\": %llu, \"min_us\": %llu, \"max_us\": %llu, "
+             "\"p50_us\": %llu, \"p99_us\": %llu}", first ? "" : ",", timing_names[phase],
+             samples->count, (unsigned long long)samples->total,
+             (unsigned long long)samples->us[0],
+             (unsigned long long)samples->us[samples->count - 1],
+             (unsigned long long)timing_percentile(samples, 50),
+             (unsigned long long)timing_percentile(samples, 99));
+    } else {
+      printf("%-12s %7u %11.1f %10.2f %10.2f %10.2f %10.2f\n", timing_names[phase],
+             samples->count, samples->total / 1000.0, samples->us[0] / 1000.0,
+             samples->us[samples->count - 1] / 1000.0,
+             timing_percentile(samples, 50) / 1000.0, timing_percentile(samples, 99) / 1000.0);
+    }
+    first = false;
+  }
+
+  if (json)
+    printf("\n}}\n");
+}
@@ -0,0 +1,59 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef _TIMING_H
+#define _TIMING_H
+
+#include <stdint.h>
+
+#include "stlink.h"
+
+/* Phases of a DFU session, tmERASE..tmWRITE follow enum DFUOperation */
+enum TimingPhase {
+  tmSESSION = 0,
+  tmENUMERATE,
+  tmDFU_SWITCH,
+  tmREAD_INFO,
+  tmLOAD,
+  tmERASE,
+  tmSET_ADDRESS,
+  tmWRITE,
+  tmTRANSFER,
+  tmPOLL_SLEEP,
+  tmVERIFY,
+  tmCONFIG,
+  tmEXIT_DFU,
+  tmCOUNT
+};
+
+extern bool timing_enabled;
+
+/*
+ * TIMING_BEGIN()/TIMING_END() bracket a phase. With --timings off they
+ * only test timing_enabled, the clock is not read.
+ */
+#define TIMING_BEGIN() (timing_enabled ? stlink_time_us() : 0)
+#define TIMING_END(phase, start) \
+  do { if (timing_enabled) timing_record(phase, stlink_time_us() - (start)); } while (0)
+
+void timing_record(enum TimingPhase phase, uint64_t elapsed_us);
+void timing_report(bool json);
+
+#endif //_TIMING_H
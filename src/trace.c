@@ -0,0 +1,295 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * USB transfer trace for --trace. Transfers are recorded into a ring
+ * buffer without locks: a writer claims a slot with an atomic increment
+ * and publishes it by storing its sequence number last. trace_save()
+ * writes the ring as a pcap file in the usbmon format
+ * (LINKTYPE_USB_LINUX_MMAPPED), one submit and one complete event per
+ * transfer, that Wireshark can open.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "trace.h"
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+struct TraceRecord {
+  uint64_t seq;
+  uint64_t start_us;
+  uint64_t end_us;
+  int32_t status;
+  uint32_t length;
+  uint32_t actual;
+  uint32_t captured;
+  uint16_t bus;
+  uint8_t device;
+  uint8_t endpoint;
+  uint8_t xfer_type;
+  uint8_t has_setup;
+  uint8_t setup[8];
+  uint8_t data[TRACE_SNAPLEN];
+};
+
+/* Header of a usbmon event, host byte order */
+struct UsbmonPacket {
+  uint64_t id;
+  uint8_t type;
+  uint8_t xfer_type;
+  uint8_t epnum;
+  uint8_t devnum;
+  uint16_t busnum;
+  char flag_setup;
+  char flag_data;
+  int64_t ts_sec;
+  int32_t ts_usec;
+  int32_t status;
+  uint32_t length;
+  uint32_t len_cap;
+  uint8_t setup[8];
+  int32_t interval;
+  int32_t start_frame;
+  uint32_t xfer_flags;
+  uint32_t ndesc;
+};
+
+bool trace_enabled = false;
+
+static struct TraceRecord *trace_ring;
+static uint64_t trace_next;
+
+int trace_start(void) {
+  trace_ring = calloc(TRACE_RECORDS, sizeof(*trace_ring));
+  if (!trace_ring) {
+    fprintf(stderr, "Not enough memory for the trace buffer\n");
+    return -1;
+  }
+  trace_enabled = true;
+  return 0;
+}
+
+/* usbmon reports the URB status as a negative errno */
+static int32_t trace_errno(int status) {
+  switch (status) {
+  case LIBUSB_SUCCESS:
+    return 0;
+  case LIBUSB_ERROR_TIMEOUT:
+    return -ETIMEDOUT;
+  case LIBUSB_ERROR_PIPE:
+    return -EPIPE;
+  case LIBUSB_ERROR_NO_DEVICE:
+    return -ENODEV;
+  case LIBUSB_ERROR_OVERFLOW:
+    return -EOVERFLOW;
+  default:
+    return -EIO;
+  }
+}
+
+void trace_record(libusb_device_handle *handle, uint8_t xfer_type, unsigned char endpoint,
+                  const uint8_t *setup, const unsigned char *data, int length, int actual,
+                  int status, uint64_t start_us) {
+  struct TraceRecord *record;
+  libusb_device *dev;
+  uint64_t seq;
+  int captured;
+
+  if (!trace_enabled)
+    return;
+
+  seq = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+  record = &trace_ring[seq % TRACE_RECORDS];
+  __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+
+  record->start_us = start_us;
+  record->end_us = stlink_time_us();
+  record->status = trace_errno(status);
+  record->length = length;
+  record->actual = actual > 0 ? actual : 0;
+  record->xfer_type = xfer_type;
+  record->endpoint = endpoint;
+  /* Emulated transfers have no device, they show up as bus 0 */
+  if (handle) {
+    dev = libusb_get_device(handle);
+    record->bus = libusb_get_bus_number(dev);
+    record->device = libusb_get_device_address(dev);
+  } else {
+    record->bus = 0;
+    record->device = 0;
+  }
+  record->has_setup = setup != NULL;
+  if (setup)
+    memcpy(record->setup, setup, 8);
+
+  /* Data goes with the submit event for OUT, with the completion for IN */
+  captured = (endpoint & LIBUSB_ENDPOINT_IN) ? actual : length;
+  if (captured < 0 || !data)
+    captured = 0;
+  if (captured > TRACE_SNAPLEN)
+    captured = TRACE_SNAPLEN;
+  record->captured = captured;
+  memcpy(record->data, data, captured);
+
+  __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Completion of an async transfer, called from its libusb callback */
+void trace_transfer_done(struct libusb_transfer *transfer, uint64_t start_us) {
+  int status;
+
+  if (!trace_enabled)
+    return;
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    status = LIBUSB_SUCCESS;
+    break;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    status = LIBUSB_ERROR_TIMEOUT;
+    break;
+  case LIBUSB_TRANSFER_STALL:
+    status = LIBUSB_ERROR_PIPE;
+    break;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    status = LIBUSB_ERROR_NO_DEVICE;
+    break;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    status = LIBUSB_ERROR_OVERFLOW;
+    break;
+  default:
+    status = LIBUSB_ERROR_IO;
+    break;
+  }
+  trace_record(transfer->dev_handle, TRACE_BULK, transfer->endpoint, NULL, transfer->buffer,
+               transfer->length, transfer->actual_length, status, start_us);
+}
+
+int trace_bulk_transfer(libusb_device_handle *handle, unsigned char endpoint,
+                        unsigned char *data, int length, int *transferred, unsigned int timeout) {
+  uint64_t start_us = trace_enabled ? stlink_time_us() : 0;
+  int res;
+
+  *transferred = 0;
+  res = libusb_bulk_transfer(handle, endpoint, data, length, transferred, timeout);
+  trace_record(handle, TRACE_BULK, endpoint, NULL, data, length,
+               *transferred, res, start_us);
+  return res;
+}
+
+int trace_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t request,
+                           uint16_t value, uint16_t index, unsigned char *data, uint16_t length,
+                           unsigned int timeout) {
+  uint64_t start_us = trace_enabled ? stlink_time_us() : 0;
+  uint8_t setup[8] = {request_type, request, value & 0xFF, value >> 8,
+                      index & 0xFF, index >> 8, length & 0xFF, length >> 8};
+  int res;
+
+  res = libusb_control_transfer(handle, request_type, request, value, index, data, length, timeout);
+  trace_record(handle, TRACE_CONTROL, request_type & LIBUSB_ENDPOINT_IN, setup, data, length,
+               res, res < 0 ? res : LIBUSB_SUCCESS, start_us);
+  return res;
+}
+
+static void trace_write_event(FILE *fd, const struct TraceRecord *record, uint64_t id, bool submit,
+                              int64_t clock_offset_us) {
+  struct UsbmonPacket packet;
+  uint32_t header[4];
+  uint64_t ts = (submit ? record->start_us : record->end_us) + clock_offset_us;
+  bool data_in = (record->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+  /* OUT data is shown on the submit event, IN data on the completion */
+  bool has_data = (submit != data_in);
+  uint32_t data_len = has_data ? (data_in ? record->actual : record->length) : 0;
+  uint32_t captured = has_data ? record->captured : 0;
+
+  memset(&packet, 0, sizeof(packet));
+  packet.id = id;
+  packet.type = submit ? 'S' : (record->status ? 'E' : 'C');
+  packet.xfer_type = record->xfer_type;
+  packet.epnum = record->endpoint;
+  packet.devnum = record->device;
+  packet.busnum = record->bus;
+  packet.flag_setup = (submit && record->has_setup) ? 0 : '-';
+  packet.flag_data = has_data ? 0 : (data_in ? '<' : '>');
+  packet.ts_sec = ts / 1000000;
+  packet.ts_usec = ts % 1000000;
+  packet.status = submit ? -EINPROGRESS : record->status;
+  packet.length = submit ? record->length : record->actual;
+  packet.len_cap = captured;
+  if (record->has_setup)
+    memcpy(packet.setup, record->setup, 8);
+
+  header[0] = packet.ts_sec;
+  header[1] = packet.ts_usec;
+  header[2] = sizeof(packet) + captured;
+  header[3] = sizeof(packet) + data_len;
+  fwrite(header, sizeof(header), 1, fd);
+  fwrite(&packet, sizeof(packet), 1, fd);
+  fwrite(record->data, 1, captured, fd);
+}
+
+int trace_save(const char *filename) {
+  uint32_t pcap_header[6] = {PCAP_MAGIC, 2 | 4 << 16, 0, 0, 0xFFFF, LINKTYPE_USB_LINUX_MMAPPED};
+  uint64_t next, first, i, written = 0;
+  const struct TraceRecord *record;
+  struct timeval now;
+  int64_t clock_offset_us;
+  FILE *fd;
+
+  if (!trace_ring)
+    return -1;
+
+  fd = fopen(filename, "wb");
+  if (fd == NULL) {
+    fprintf(stderr, "Opening File %s Failed\n", filename);
+    return -1;
+  }
+  fwrite(pcap_header, sizeof(pcap_header), 1, fd);
+
+  /* Records carry the monotonic clock, pcap wants the wall clock */
+  gettimeofday(&now, NULL);
+  clock_offset_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec - stlink_time_us();
+
+  next = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+  first = next > TRACE_RECORDS ? next - TRACE_RECORDS : 0;
+  for (i = first; i < next; i++) {
+    record = &trace_ring[i % TRACE_RECORDS];
+    /* Skip slots still being written or already reused */
+    if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != i + 1)
+      continue;
+    trace_write_event(fd, record, i, true, clock_offset_us);
+    trace_write_event(fd, record, i, false, clock_offset_us);
+    written++;
+  }
+  fclose(fd);
+
+  printf("Saved %llu of %llu USB transfers to %s\n", (unsigned long long)written,
+         (unsigned long long)next, filename);
+  trace_enabled = false;
+  free(trace_ring);
+  trace_ring = NULL;
+  return 0;
+}
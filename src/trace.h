@@ -0,0 +1,55 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+#include "stlink.h"
+
+/* Transfers kept by --trace, the oldest ones are overwritten */
+#define TRACE_RECORDS 4096
+/* Payload bytes kept per transfer, a whole DFU chunk */
+#define TRACE_SNAPLEN 0x800
+
+/* usbmon transfer types, xfer_type of trace_record() */
+#define TRACE_CONTROL 2
+#define TRACE_BULK    3
+
+extern bool trace_enabled;
+
+int trace_start(void);
+int trace_save(const char *filename);
+
+void trace_record(libusb_device_handle *handle, uint8_t xfer_type, unsigned char endpoint,
+                  const uint8_t *setup, const unsigned char *data, int length, int actual,
+                  int status, uint64_t start_us);
+void trace_transfer_done(struct libusb_transfer *transfer, uint64_t start_us);
+
+/* libusb_bulk_transfer() and libusb_control_transfer() recorded by --trace */
+int trace_bulk_transfer(libusb_device_handle *handle, unsigned char endpoint,
+                        unsigned char *data, int length, int *transferred, unsigned int timeout);
+int trace_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t request,
+                           uint16_t value, uint16_t index, unsigned char *data, uint16_t length,
+                           unsigned int timeout);
+
+#endif //_TRACE_H
@@ -0,0 +1,337 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Transports of stlink.c: libusb for dongles, and an in-process loopback
+ * to the emulator. The loopback can add a fixed latency to every
+ * transfer, so the DFU logic, chunking and crypto can be measured at
+ * full CPU speed or with a given bus delay. For --record a transport logs
+ * the transfers of another one, for --replay one answers them from the
+ * recording with the recorded bus times.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "emulator.h"
+#include "record.h"
+#include "trace.h"
+
+static int transport_libusb_bulk(struct Transport *transport, unsigned char endpoint,
+      unsigned char *data, int length, int *transferred, unsigned int timeout) {
+  transport->transfers++;
+  return trace_bulk_transfer(transport->handle, endpoint, data, length, transferred, timeout);
+}
+
+static int transport_libusb_submit(struct Transport *transport, struct libusb_transfer *transfer) {
+  transport->transfers++;
+  return libusb_submit_transfer(transfer);
+}
+
+static int transport_libusb_cancel(struct Transport *transport, struct libusb_transfer *transfer) {
+  return libusb_cancel_transfer(transfer);
+}
+
+static int transport_libusb_events(struct Transport *transport, int *completed) {
+  return libusb_handle_events_completed(transport->usb_ctx, completed);
+}
+
+static int transport_libusb_clear_halt(struct Transport *transport, unsigned char endpoint) {
+  return libusb_clear_halt(transport->handle, endpoint);
+}
+
+static const struct TransportOps transport_libusb_ops = {
+  .name = "libusb",
+  .send = transport_libusb_bulk,
+  .receive = transport_libusb_bulk,
+  .submit = transport_libusb_submit,
+  .cancel = transport_libusb_cancel,
+  .handle_events = transport_libusb_events,
+  .clear_halt = transport_libusb_clear_halt,
+};
+
+void transport_libusb(struct Transport *transport, libusb_context *usb_ctx,
+                      libusb_device_handle *handle) {
+  memset(transport, 0, sizeof(*transport));
+  transport->ops = &transport_libusb_ops;
+  transport->usb_ctx = usb_ctx;
+  transport->handle = handle;
+}
+
+/* Transfers go over the bus one at a time, each one is done when the previous one is */
+static uint64_t transport_bus_due(struct Transport *transport, uint64_t service_us) {
+  uint64_t now = stlink_time_us();
+
+  transport->transfers++;
+  if (transport->busy_until_us < now)
+    transport->busy_until_us = now;
+  transport->busy_until_us += service_us;
+  return transport->busy_until_us;
+}
+
+static uint64_t transport_loopback_due(struct Transport *transport, int length) {
+  return transport_bus_due(transport, transport->latency_us + (uint64_t)length * transport->byte_ns / 1000);
+}
+
+static void transport_loopback_sleep(uint64_t until_us) {
+  uint64_t now = stlink_time_us();
+
+  if (until_us > now)
+    usleep(until_us - now);
+}
+
+static int transport_loopback_bulk(struct Transport *transport, unsigned char endpoint,
+      unsigned char *data, int length, int *transferred, unsigned int timeout) {
+  uint64_t start_us = trace_enabled ? stlink_time_us() : 0;
+  int res;
+
+  transport_loopback_sleep(transport_loopback_due(transport, length));
+  res = emulator_bulk_transfer(transport->device, endpoint, data, length, transferred);
+  trace_record(NULL, TRACE_BULK, endpoint, NULL, data, length, *transferred, res, start_us);
+  return res;
+}
+
+static int transport_loopback_submit(struct Transport *transport, struct libusb_transfer *transfer) {
+  if (transport->queued == TRANSPORT_QUEUE)
+    return LIBUSB_ERROR_BUSY;
+  transport->queue[transport->queued] = transfer;
+  transport->due_us[transport->queued] = transport_loopback_due(transport, transfer->length);
+  transport->queued++;
+  return 0;
+}
+
+static struct libusb_transfer *transport_loopback_pop(struct Transport *transport, unsigned int i) {
+  struct libusb_transfer *transfer = transport->queue[i];
+
+  transport->queued--;
+  memmove(transport->queue + i, transport->queue + i + 1,
+          (transport->queued - i) * sizeof(transport->queue[0]));
+  memmove(transport->due_us + i, transport->due_us + i + 1,
+          (transport->queued - i) * sizeof(transport->due_us[0]));
+  memmove(transport->entries + i, transport->entries + i + 1,
+          (transport->queued - i) * sizeof(transport->entries[0]));
+  return transfer;
+}
+
+/* The device sees the transfers in order, when they are due */
+static int transport_loopback_events(struct Transport *transport, int *completed) {
+  if (!transport->queued)
+    return LIBUSB_ERROR_NOT_FOUND;
+  transport_loopback_sleep(transport->due_us[0]);
+  return emulator_submit_transfer(transport->device, transport_loopback_pop(transport, 0));
+}
+
+static int transport_loopback_cancel(struct Transport *transport, struct libusb_transfer *transfer) {
+  unsigned int i;
+
+  for (i = 0; i < transport->queued; i++) {
+    if (transport->queue[i] == transfer) {
+      transport_loopback_pop(transport, i);
+      transfer->status = LIBUSB_TRANSFER_CANCELLED;
+      transfer->actual_length = 0;
+      transfer->callback(transfer);
+      return 0;
+    }
+  }
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int transport_loopback_clear_halt(struct Transport *transport, unsigned char endpoint) {
+  return 0;
+}
+
+static const struct TransportOps transport_loopback_ops = {
+  .name = "loopback",
+  .send = transport_loopback_bulk,
+  .receive = transport_loopback_bulk,
+  .submit = transport_loopback_submit,
+  .cancel = transport_loopback_cancel,
+  .handle_events = transport_loopback_events,
+  .clear_halt = transport_loopback_clear_halt,
+};
+
+void transport_loopback(struct Transport *transport, struct Emulator *device,
+                        uint32_t latency_us, uint32_t byte_ns) {
+  memset(transport, 0, sizeof(*transport));
+  transport->ops = &transport_loopback_ops;
+  transport->device = device;
+  transport->latency_us = latency_us;
+  transport->byte_ns = byte_ns;
+}
+
+static int transport_record_bulk(struct Transport *transport, unsigned char endpoint,
+      unsigned char *data, int length, int *transferred, unsigned int timeout) {
+  struct Transport *inner = transport->inner;
+  int entry = record_add(transport->recording, endpoint, data, length);
+  uint64_t start_us = stlink_time_us();
+  int res;
+
+  transport->transfers++;
+  if (endpoint & LIBUSB_ENDPOINT_IN)
+    res = inner->ops->receive(inner, endpoint, data, length, transferred, timeout);
+  else
+    res = inner->ops->send(inner, endpoint, data, length, transferred, timeout);
+  record_done(transport->recording, entry, data, *transferred, res, start_us, stlink_time_us());
+  return res;
+}
+
+/* Logs the completion and hands the transfer back to its own callback */
+static void LIBUSB_CALL transport_record_done(struct libusb_transfer *transfer) {
+  struct TransportHook *hook = transfer->user_data;
+
+  transfer->callback = hook->callback;
+  transfer->user_data = hook->user_data;
+  hook->callback = NULL;
+  record_done(hook->transport->recording, hook->entry, transfer->buffer, transfer->actual_length,
+              record_status(transfer->status), hook->submit_us, stlink_time_us());
+  transfer->callback(transfer);
+}
+
+static int transport_record_submit(struct Transport *transport, struct libusb_transfer *transfer) {
+  struct TransportHook *hook = NULL;
+  unsigned int i;
+  int res;
+
+  for (i = 0; i < TRANSPORT_QUEUE && !hook; i++) {
+    if (!transport->hooks[i].callback)
+      hook = &transport->hooks[i];
+  }
+  if (!hook)
+    return LIBUSB_ERROR_BUSY;
+
+  hook->transport = transport;
+  hook->callback = transfer->callback;
+  hook->user_data = transfer->user_data;
+  hook->submit_us = stlink_time_us();
+  transfer->callback = transport_record_done;
+  transfer->user_data = hook;
+  res = transport->inner->ops->submit(transport->inner, transfer);
+  if (res) {
+    transfer->callback = hook->callback;
+    transfer->user_data = hook->user_data;
+    hook->callback = NULL;
+    return res;
+  }
+  /* Completions only come from handle_events(), the entry is reserved in time */
+  hook->entry = record_add(transport->recording, transfer->endpoint, transfer->buffer, transfer->length);
+  transport->transfers++;
+  return 0;
+}
+
+static int transport_record_cancel(struct Transport *transport, struct libusb_transfer *transfer) {
+  return transport->inner->ops->cancel(transport->inner, transfer);
+}
+
+static int transport_record_events(struct Transport *transport, int *completed) {
+  return transport->inner->ops->handle_events(transport->inner, completed);
+}
+
+static int transport_record_clear_halt(struct Transport *transport, unsigned char endpoint) {
+  return transport->inner->ops->clear_halt(transport->inner, endpoint);
+}
+
+static const struct TransportOps transport_record_ops = {
+  .name = "record",
+  .send = transport_record_bulk,
+  .receive = transport_record_bulk,
+  .submit = transport_record_submit,
+  .cancel = transport_record_cancel,
+  .handle_events = transport_record_events,
+  .clear_halt = transport_record_clear_halt,
+};
+
+void transport_record(struct Transport *transport, struct Transport *inner,
+                      struct Recording *recording) {
+  memset(transport, 0, sizeof(*transport));
+  transport->ops = &transport_record_ops;
+  transport->inner = inner;
+  transport->recording = recording;
+}
+
+static uint64_t transport_replay_due(struct Transport *transport, const struct RecordEntry *entry) {
+  uint64_t service_us = entry->service_us * transport->scale;
+
+  transport->recording->replay_bus_us += service_us;
+  return transport_bus_due(transport, service_us);
+}
+
+static int transport_replay_bulk(struct Transport *transport, unsigned char endpoint,
+      unsigned char *data, int length, int *transferred, unsigned int timeout) {
+  uint64_t start_us = trace_enabled ? stlink_time_us() : 0;
+  const struct RecordEntry *entry = record_next(transport->recording, endpoint, data, length);
+
+  *transferred = 0;
+  if (!entry)
+    return LIBUSB_ERROR_IO;
+  transport_loopback_sleep(transport_replay_due(transport, entry));
+  *transferred = record_fill(transport->recording, entry, data, length);
+  trace_record(NULL, TRACE_BULK, endpoint, NULL, data, length, *transferred, entry->status, start_us);
+  return entry->status;
+}
+
+static int transport_replay_submit(struct Transport *transport, struct libusb_transfer *transfer) {
+  const struct RecordEntry *entry;
+
+  if (transport->queued == TRANSPORT_QUEUE)
+    return LIBUSB_ERROR_BUSY;
+  entry = record_next(transport->recording, transfer->endpoint, transfer->buffer, transfer->length);
+  if (!entry)
+    return LIBUSB_ERROR_IO;
+  transport->queue[transport->queued] = transfer;
+  transport->due_us[transport->queued] = transport_replay_due(transport, entry);
+  transport->entries[transport->queued] = entry;
+  transport->queued++;
+  return 0;
+}
+
+static int transport_replay_events(struct Transport *transport, int *completed) {
+  const struct RecordEntry *entry;
+  struct libusb_transfer *transfer;
+
+  if (!transport->queued)
+    return LIBUSB_ERROR_NOT_FOUND;
+  transport_loopback_sleep(transport->due_us[0]);
+  entry = transport->entries[0];
+  transfer = transport_loopback_pop(transport, 0);
+  transfer->actual_length = record_fill(transport->recording, entry, transfer->buffer, transfer->length);
+  transfer->status = record_transfer_status(entry->status);
+  transfer->callback(transfer);
+  return 0;
+}
+
+static const struct TransportOps transport_replay_ops = {
+  .name = "replay",
+  .send = transport_replay_bulk,
+  .receive = transport_replay_bulk,
+  .submit = transport_replay_submit,
+  .cancel = transport_loopback_cancel,
+  .handle_events = transport_replay_events,
+  .clear_halt = transport_loopback_clear_halt,
+};
+
+void transport_replay(struct Transport *transport, struct Recording *recording, double scale) {
+  memset(transport, 0, sizeof(*transport));
+  transport->ops = &transport_replay_ops;
+  transport->recording = recording;
+  transport->scale = scale;
+  recording->start_us = stlink_time_us();
+}
@@ -0,0 +1,94 @@
+/*
+  Copyright (c) 2026 The stlink-tool contributors.
+  
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the Software
+  is furnished to do so, subject to the following conditions:
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+  OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+/* Async transfers a loopback transport can have in flight */
+#define TRANSPORT_QUEUE 8
+
+struct Emulator;
+struct Recording;
+struct RecordEntry;
+struct Transport;
+
+/*
+ * How stlink.c reaches the bootloader. Transfers are described with a
+ * struct libusb_transfer for every backend, submit() queues one and
+ * handle_events() completes them by calling their callback, like the
+ * libusb event loop.
+ */
+struct TransportOps {
+  const char *name;
+  int (*send)(struct Transport *transport, unsigned char endpoint, unsigned char *data,
+              int length, int *transferred, unsigned int timeout);
+  int (*receive)(struct Transport *transport, unsigned char endpoint, unsigned char *data,
+                 int length, int *transferred, unsigned int timeout);
+  int (*submit)(struct Transport *transport, struct libusb_transfer *transfer);
+  int (*cancel)(struct Transport *transport, struct libusb_transfer *transfer);
+  int (*handle_events)(struct Transport *transport, int *completed);
+  int (*clear_halt)(struct Transport *transport, unsigned char endpoint);
+};
+
+/* Async transfer passed on by a recording transport, with the callback it had */
+struct TransportHook {
+  struct Transport *transport;
+  libusb_transfer_cb_fn callback;
+  void *user_data;
+  int entry;
+  uint64_t submit_us;
+};
+
+struct Transport {
+  const struct TransportOps *ops;
+  /* libusb */
+  libusb_context *usb_ctx;
+  libusb_device_handle *handle;
+  /* loopback, a transfer takes latency_us plus byte_ns per byte before the device sees it */
+  struct Emulator *device;
+  uint32_t latency_us;
+  uint32_t byte_ns;
+  uint64_t busy_until_us;
+  struct libusb_transfer *queue[TRANSPORT_QUEUE];
+  uint64_t due_us[TRANSPORT_QUEUE];
+  unsigned int queued;
+  /* record, transfers go to inner and are logged */
+  struct Transport *inner;
+  struct TransportHook hooks[TRANSPORT_QUEUE];
+  /* record and replay, a replay uses the loopback queue with the recorded bus times times scale */
+  struct Recording *recording;
+  const struct RecordEntry *entries[TRANSPORT_QUEUE];
+  double scale;
+  /* Bulk transfers so far, each one is a round-trip on the bus */
+  uint64_t transfers;
+};
+
+void transport_libusb(struct Transport *transport, libusb_context *usb_ctx,
+                      libusb_device_handle *handle);
+void transport_loopback(struct Transport *transport, struct Emulator *device,
+                        uint32_t latency_us, uint32_t byte_ns);
+void transport_record(struct Transport *transport, struct Transport *inner,
+                      struct Recording *recording);
+void transport_replay(struct Transport *transport, struct Recording *recording, double scale);
+
+#endif //_TRANSPORT_H